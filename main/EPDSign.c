@@ -18,6 +18,15 @@ static const char TAG[] = "EPDSign";
 #include <hal/spi_types.h>
 #include <driver/gpio.h>
 #include "lwpng.h"
+#include "esp_rom_crc.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_mac.h"
+#include "esp_heap_caps.h"
+#include "esp_wifi.h"
+#include "esp_pm.h"
+#include "snmp.h"
+#include "planes.h"
 
 #define	LEFT	0x80            // Flags on font size
 #define	RIGHT	0x40
@@ -29,60 +38,395 @@ const char sd_mount[] = "/sd";
 uint64_t sdsize = 0,            // SD card data
    sdfree = 0;
 
-static struct
-{                               // Flags
-   uint8_t wificonnect:1;
-   uint8_t redraw:1;
-   uint8_t lightoverride:1;
-   uint8_t startup:1;
-} volatile b = { 0 };
+static EventGroupHandle_t events = NULL;
+
+enum
+{                               // Events, and state, for the main loop
+   EV_WIFICONNECT = (1 << 0),   // WiFi (re)connected
+   EV_REDRAW = (1 << 1),        // Redraw now
+   EV_SETTING = (1 << 2),       // Settings changed
+   EV_STARTUP = (1 << 3),       // Started, i.e. had WiFi (state, not cleared)
+   EV_LIGHTOVERRIDE = (1 << 4), // Lights set by command (state)
+   EV_FETCH = (1 << 5),         // Check image now
+};
+#define	EV_WAKE	(EV_WIFICONNECT|EV_REDRAW|EV_SETTING)   // Events that wake main loop
+
+static void
+event_set (EventBits_t e)
+{
+   if (events)
+      xEventGroupSetBits (events, e);
+}
+
+static inline EventBits_t
+event_get (void)
+{
+   return events ? xEventGroupGetBits (events) : 0;
+}
 
 volatile uint32_t override = 0;
 int defcon = -1;                // DEFCON level
-char season = 0;
 #define	BINMAX	6
+#define	CACHEMAX	86400   // Longest we let a server hint delay a recheck
+#define	BACKOFFMAX	3600    // Longest back off after errors
+#define	CARDCHUNK	4096    // SD card read size
+#define	SNMPPOLL	60      // SNMP poll interval
+#define	SNMPSTALE	(SNMPPOLL*3)    // SNMP uptime no longer shown if no reply for this long
+#define	PANELSETTLE	100     // Time for e-paper supply to settle after gfxena on (ms)
+#define	LISTENINTERVAL	10      // Low power WiFi listen interval (beacons, about 1s)
 
 led_strip_handle_t strip = NULL;
 sdmmc_card_t *card = NULL;
 
-const char *
-gfx_qr (const char *value, uint32_t max)
+const char *image_push (jo_t j);
+
+// Performance telemetry, values (mostly us) are aggregated and reported every perfreport seconds
+
+enum
 {
-#ifndef	CONFIG_GFX_NONE
+   PERF_CONNECT,                // HTTP open, i.e. DNS, TCP, and TLS
+   PERF_HEADERS,                // HTTP response headers
+   PERF_BODY,                   // HTTP body, including decode
+   PERF_BYTES,                  // HTTP body bytes (not a time)
+   PERF_DECODE,                 // Decode (PNG inflate and pixels, or native)
+   PERF_CHECK,                  // check_file, i.e. pre-render
+   PERF_SDREAD,                 // Load from SD card, including decode
+   PERF_SDWRITE,                // Writing to SD card
+   PERF_PLOT,                   // Image plot
+   PERF_OVERLAY,                // Frame draw, including image plot
+   PERF_UPDATE,                 // Display update, including BUSY wait
+   PERF_SNMP,                   // SNMP round trip
+   PERF_MAX
+};
+
+static const char *const perfname[PERF_MAX] =
+   { "connect", "headers", "body", "bytes", "decode", "check", "sdread", "sdwrite", "plot", "overlay", "update", "snmp" };
+
+#define	PERFBINS	33      // Bin n is values of n bits
+
+typedef struct perf_s
+{
+   uint32_t n;                  // Samples
+   uint32_t min;
+   uint32_t max;
+   uint64_t sum;
+   uint16_t bin[PERFBINS];      // Log2 histogram, for p95
+} perf_t;
+
+static perf_t perf[PERF_MAX] = { 0 };
+
+static SemaphoreHandle_t perf_mutex = NULL;
+
+void
+perf_add (int p, uint32_t v)
+{
+   if (!perf_mutex)
+      return;
+   xSemaphoreTake (perf_mutex, portMAX_DELAY);
+   perf_t *s = &perf[p];
+   if (!s->n || v < s->min)
+      s->min = v;
+   if (v > s->max)
+      s->max = v;
+   s->n++;
+   s->sum += v;
+   int b = (v ? 32 - __builtin_clz (v) : 0);
+   if (s->bin[b] < 0xFFFF)
+      s->bin[b]++;
+   xSemaphoreGive (perf_mutex);
+}
+
+static inline void
+perf_since (int p, int64_t start)
+{
+   perf_add (p, esp_timer_get_time () - start);
+}
+
+static int64_t awakefrom = 0;   // Start of awake accounting (us)
+static int64_t mainus = 0;      // Main loop active time (us)
+static int64_t panelus = 0;     // Panel powered time (us)
+static int64_t panelon = 0;     // When panel powered (us), 0 if off
+
+void
+perf_report (void)
+{                               // Report and reset
+   jo_t j = jo_object_alloc ();
+   xSemaphoreTake (perf_mutex, portMAX_DELAY);
+   for (int p = 0; p < PERF_MAX; p++)
+   {
+      perf_t *s = &perf[p];
+      if (!s->n)
+         continue;
+      uint32_t want = (s->n * 95 + 99) / 100,
+         count = 0,
+         p95 = s->max;
+      for (int b = 0; b < PERFBINS; b++)
+         if ((count += s->bin[b]) >= want)
+         {                      // Top of bin, as a bound
+            uint64_t top = (1ULL << b) - 1;
+            if (top < p95)
+               p95 = (top < s->min ? s->min : top);
+            break;
+         }
+      jo_object (j, perfname[p]);
+      jo_int (j, "n", s->n);
+      jo_int (j, "min", s->min);
+      jo_int (j, "avg", s->sum / s->n);
+      jo_int (j, "max", s->max);
+      jo_int (j, "p95", p95);
+      jo_close (j);
+   }
+   memset (perf, 0, sizeof (perf));
+   xSemaphoreGive (perf_mutex);
+   jo_object (j, "heap");
+   jo_int (j, "free", esp_get_free_heap_size ());
+   jo_int (j, "min", esp_get_minimum_free_heap_size ());
+   jo_int (j, "internal", heap_caps_get_minimum_free_size (MALLOC_CAP_INTERNAL));
+   jo_int (j, "spiram", heap_caps_get_minimum_free_size (MALLOC_CAP_SPIRAM));
+   jo_close (j);
+   {                            // Awake ratios
+      int64_t now = esp_timer_get_time ();
+      if (panelon)
+      {
+         panelus += now - panelon;
+         panelon = now;
+      }
+      if (now > awakefrom)
+      {
+         jo_object (j, "awake");
+         jo_litf (j, "main", "%.1f", 100.0 * mainus / (now - awakefrom));
+         if (gfxena.set)
+            jo_litf (j, "panel", "%.1f", 100.0 * panelus / (now - awakefrom));
+         jo_close (j);
+      }
+      awakefrom = now;
+      mainus = panelus = 0;
+   }
+   revk_info ("perf", &j);
+}
+
+static void
+panel_idle (void)
+{                               // Wait for panel to finish updating
+   if (!gfxbusy.set)
+      return;
+   for (int n = 0; n < 300 && gpio_get_level (gfxbusy.num) != gfxbusy.invert; n++)
+      usleep (100000);
+}
+
+static void
+panel_power (int on)
+{                               // E-paper supply via gfxena
+   if (!gfxena.set || !on == !panelon)
+      return;
+   int64_t now = esp_timer_get_time ();
+   if (on)
+      panelon = now;
+   else
+   {
+      panelus += now - panelon;
+      panelon = 0;
+   }
+   gpio_set_level (gfxena.num, on ? gfxena.invert : 1 - gfxena.invert);
+   if (on)
+      usleep (PANELSETTLE * 1000);      // Supply up, and controller out of its power on reset, before GFX talks to it
+}
+
+static void
+power_wifi (void)
+{                               // Modem sleep, waking every few beacons, else put back as it was
+   static uint8_t saved = 0;
+   static wifi_ps_type_t ps;
+   static uint16_t listen;
+#ifdef	CONFIG_PM_ENABLE
+   static esp_pm_config_t pm;
+#endif
+   if (!lowpower && !saved)
+      return;                   // Not ours to change
+   wifi_config_t cfg = { };
+   int ok = !esp_wifi_get_config (WIFI_IF_STA, &cfg);
+   if (!saved)
+   {                            // Keep as was
+      esp_wifi_get_ps (&ps);
+      listen = cfg.sta.listen_interval;
+#ifdef	CONFIG_PM_ENABLE
+      if (esp_pm_get_configuration (&pm))
+      {                         // Not configured
+         pm.max_freq_mhz = pm.min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+         pm.light_sleep_enable = 0;
+      }
+#endif
+      saved = 1;
+   }
+   // Checks wake WiFi when they send, so listen interval only delays messages to us, e.g. DEFCON, and APs drop frames held much longer
+   int l = (lowpower ? LISTENINTERVAL : listen);
+   if (ok && cfg.sta.listen_interval != l)
+   {                            // Applies on next association
+      cfg.sta.listen_interval = l;
+      esp_wifi_set_config (WIFI_IF_STA, &cfg);
+   }
+   esp_wifi_set_ps (lowpower ? WIFI_PS_MAX_MODEM : ps);
+#ifdef	CONFIG_PM_ENABLE
+   if (lowpower)
+   {
+      esp_pm_config_t low = pm;
+      low.min_freq_mhz = 40;
+      low.light_sleep_enable = 1;
+      esp_pm_configure (&low);
+   } else
+      esp_pm_configure (&pm);
+#endif
+   if (!lowpower)
+      saved = 0;                // Put back
+}
+
+#define	QRCACHE	4               // QR codes kept encoded
+
+typedef struct qr_s
+{
+   struct qr_s *next;
+   char *value;                 // Encoded string (malloc'd)
+   uint32_t max;                // Size asked for
+   uint16_t width;              // Modules
+   uint16_t line;               // Bytes per row of modules
+   uint8_t s;                   // Pixels per module
+   const char *err;             // Why not drawn
+   uint8_t bits[];              // Packed modules, 1 is black
+} qr_t;
+
+static qr_t *qrs = NULL;        // Most recently used first
+
+static qr_t *
+qr_find (const char *value, uint32_t max)
+{                               // Cached encoding of value for size max
+   qr_t **qq = &qrs,
+      *q;
+   while ((q = *qq) && (q->max != max || strcmp (q->value, value)))
+      qq = &q->next;
+   if (q)
+   {                            // Move to front
+      *qq = q->next;
+      q->next = qrs;
+      qrs = q;
+      return q;
+   }
    unsigned int width = 0;
  uint8_t *qr = qr_encode (strlen (value), value, widthp:&width);
    if (!qr)
-      return "Failed to encode";
-   if (!max)
-      max = width;
-   if (max < width)
+      width = 0;
+   uint16_t line = (width + 7) / 8;
+   q = mallocspi (sizeof (*q) + line * width);
+   if (!q)
    {
       free (qr);
-      return "No space";
+      return NULL;
    }
-   if (max > gfx_width () || max > gfx_height ())
+   memset (q, 0, sizeof (*q) + line * width);
+   q->value = strdup (value);
+   q->max = max;
+   q->width = width;
+   q->line = line;
+   if (!max)
+      max = width;
+   if (!qr)
+      q->err = "Failed to encode";
+   else if (max < width)
+      q->err = "No space";
+   else if (max > gfx_width () || max > gfx_height ())
+      q->err = "Too big";
+   else
    {
-      free (qr);
-      return "Too big";
+      q->s = max / width;
+      for (int y = 0; y < width; y++)
+         for (int x = 0; x < width; x++)
+            if (qr[width * y + x] & QR_TAG_BLACK)
+               q->bits[line * y + x / 8] |= (0x80 >> (x & 7));
+   }
+   free (qr);
+   q->next = qrs;
+   qrs = q;
+   int n = 0;
+   for (qq = &qrs; *qq && n < QRCACHE; qq = &(*qq)->next)
+      n++;
+   while ((q = *qq))
+   {                            // Drop least recently used
+      *qq = q->next;
+      free (q->value);
+      free (q);
    }
-   int s = max / width;
+   return qrs;
+}
+
+const char *
+gfx_qr (const char *value, uint32_t max)
+{
+#ifndef	CONFIG_GFX_NONE
+   qr_t *q = qr_find (value, max);
+   if (!q)
+      return "No memory";
+   if (q->err)
+      return q->err;
+   if (!max)
+      max = q->width;
    gfx_pos_t ox,
      oy;
    gfx_draw (max, max, 0, 0, &ox, &oy);
-   int d = (max - width * s) / 2;
+   int d = (max - q->width * q->s) / 2;
    ox += d;
    oy += d;
-   for (int y = 0; y < width; y++)
-      for (int x = 0; x < width; x++)
-         if (qr[width * y + x] & QR_TAG_BLACK)
-            for (int dy = 0; dy < s; dy++)
-               for (int dx = 0; dx < s; dx++)
-                  gfx_pixel (ox + x * s + dx, oy + y * s + dy, 0xFF);
-   free (qr);
+   for (int y = 0; y < q->width; y++)
+   {                            // Fill runs of black modules
+      const uint8_t *r = q->bits + q->line * y;
+      int x = 0;
+      while (x < q->width)
+      {
+         if (!(x & 7) && !r[x / 8])
+         {
+            x += 8;
+            continue;
+         }
+         if (!(r[x / 8] & (0x80 >> (x & 7))))
+         {
+            x++;
+            continue;
+         }
+         int s = x;
+         while (x < q->width && (r[x / 8] & (0x80 >> (x & 7))))
+            x++;
+         gfx_pos (ox + s * q->s, oy + y * q->s, GFX_L | GFX_T);
+         gfx_fill ((x - s) * q->s, q->s, 255);
+      }
+   }
 #endif
    return NULL;
 }
 
+time_t
+parse_http_time (const char *t)
+{                               // HTTP date, e.g. Sun, 06 Nov 1994 08:49:37 GMT
+   static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+   int y = 0,
+      d = 0,
+      H = 0,
+      M = 0,
+      S = 0;
+   char mon[4] = "";
+   if (sscanf (t, "%*[^,], %d %3s %d %d:%d:%d", &d, mon, &y, &H, &M, &S) != 6 || strlen (mon) != 3)
+      return 0;
+   const char *p = strstr (months, mon);
+   if (!p || (p - months) % 3)
+      return 0;
+   int m = (p - months) / 3 + 1;
+   // Days since 1970 for proleptic Gregorian date
+   y -= (m <= 2);
+   int era = (y >= 0 ? y : y - 399) / 400;
+   int yoe = y - era * 400;
+   int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+   int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+   int64_t days = (int64_t) era * 146097 + doe - 719468;
+   return days * 86400 + H * 3600 + M * 60 + S;
+}
+
 const char *const longday[] = { "SUNDAY", "MONDAY", "TUESDAY", "WEDNESDAY", "THURSDAY", "FRIDAY", "SATURDAY" };
 
 time_t
@@ -146,6 +490,8 @@ setdefcon (int level, char *value)
 const char *
 app_callback (int client, const char *prefix, const char *target, const char *suffix, jo_t j)
 {
+   if (j && !client && prefix && !target && !strcmp (prefix, topiccommand) && suffix && !strcmp (suffix, "image"))
+      return image_push (j);    // Not a string
    char value[1000];
    int len = 0;
    *value = 0;
@@ -160,7 +506,7 @@ app_callback (int client, const char *prefix, const char *target, const char *su
    if (prefix && !strcmp (prefix, "DEFCON") && target && isdigit ((int) *target) && !target[1])
    {
       const char *err = setdefcon (*target - '0', value);
-      b.redraw = 1;
+      event_set (EV_REDRAW);
       return err;
    }
    if (client || !prefix || target || strcmp (prefix, topiccommand) || !suffix)
@@ -168,7 +514,7 @@ app_callback (int client, const char *prefix, const char *target, const char *su
    // Not for us or not a command from main MQTT
    if (!strcmp (suffix, "setting"))
    {
-      b.redraw = 1;
+      event_set (EV_SETTING | EV_REDRAW | EV_FETCH);
       return "";
    }
    if (!strcmp (suffix, "connect"))
@@ -187,12 +533,15 @@ app_callback (int client, const char *prefix, const char *target, const char *su
    }
    if (!strcmp (suffix, "wifi") || !strcmp (suffix, "ipv6") || !strcmp (suffix, "ap"))
    {
-      b.wificonnect = 1;
+      event_set (EV_WIFICONNECT | EV_FETCH);
       return "";
    }
    if (strip && !strcmp (suffix, "rgb"))
    {
-      b.lightoverride = (*value ? 1 : 0);
+      if (*value)
+         event_set (EV_LIGHTOVERRIDE);
+      else if (events)
+         xEventGroupClearBits (events, EV_LIGHTOVERRIDE);
       showlights (value);
       return "";
    }
@@ -202,25 +551,56 @@ app_callback (int client, const char *prefix, const char *target, const char *su
 typedef struct file_s
 {
    struct file_s *next;         // Next file in chain
+   struct file_s *hnext;        // Next file in hash chain
    char *url;                   // URL as passed to download
+   uint32_t used;               // Uptime last used
    uint32_t cache;              // Cache until this uptiome
    time_t changed;              // Last changed
    uint32_t size;               // File size
-   uint32_t w;                  // PNG width
-   uint32_t h;                  // PNG height
-   uint8_t *data;               // File data
-   uint8_t new:1;               // New file
-   uint8_t card:1;              // We have tried card
-   uint8_t json:1;              // Is JSON
+   uint32_t hash;               // File CRC32
+   uint32_t cardsize;           // File size on SD card
+   uint32_t cardhash;           // File CRC32 on SD card
+   uint32_t w;                  // Image width (as stored, clipped to display)
+   uint32_t h;                  // Image height (as stored, clipped to display)
+   uint32_t line;               // Image bytes per row (whole words)
+   char *etag;                  // Server ETag
+   char *modified;              // Server Last-Modified
+   uint8_t *data;               // File data (JSON only)
+   uint8_t *bits;               // Image pixels, 1 bit per pixel, bit 7 left
+   uint8_t *mask;               // Image opaque pixels, 1 bit per pixel, bit 7 left
+   uint8_t *red;                // Image red pixels (red displays), 1 bit per pixel, bit 7 left
+   uint8_t *plotk;              // Pre-rendered black pixels for plot mode
+   uint8_t *plotw;              // Pre-rendered white pixels for plot mode
+   uint8_t plot;                // Plot mode pre-rendered (+1)
+   uint8_t plotr;               // Red plane is drawn in this plot mode
+   uint8_t fails;               // Consecutive failed checks
+   // Not bit fields, as the fetch task and main loop write different flags, not always holding image_mutex
+   uint8_t new;                 // New file
+   uint8_t card;                // We have tried card
+   uint8_t native;              // Native format, so can be patched
+   uint8_t json;                // Is JSON
 } file_t;
 
-file_t *files = NULL;
+file_t *files = NULL;           // Owned by fetch task
+#define	FILEHASH	16
+file_t *filehash[FILEHASH] = { 0 };     // Files by URL hash
+file_t *volatile image = NULL;  // Current image, published by fetch task
+SemaphoreHandle_t image_mutex = NULL;   // Held to change, or draw, image content
+uint32_t cachebytes = 0;        // Memory used by files
+uint32_t cacheevicted = 0;      // Files freed to stay in budget
+
+static inline file_t **
+file_bucket (const char *url)
+{
+   return &filehash[esp_rom_crc32_le (0, (const uint8_t *) url, strlen (url)) % FILEHASH];
+}
 
 file_t *
 find_file (char *url)
 {
+   file_t **h = file_bucket (url);
    file_t *i;
-   for (i = files; i && strcmp (i->url, url); i = i->next);
+   for (i = *h; i && strcmp (i->url, url); i = i->hnext);
    if (!i)
    {
       i = mallocspi (sizeof (*i));
@@ -230,260 +610,2173 @@ find_file (char *url)
          i->url = strdup (url);
          i->next = files;
          files = i;
+         i->hnext = *h;
+         *h = i;
+      }
+   }
+   if (i)
+      i->used = uptime ();
+   return i;
+}
+
+static uint32_t
+file_bytes (file_t * i)
+{                               // Memory used by file
+   uint32_t n = sizeof (*i) + strlen (i->url) + 1;
+   uint32_t plane = i->line * i->h;
+   if (i->data)
+      n += i->size;
+   if (i->bits)
+      n += plane;
+   if (i->mask)
+      n += plane;
+   if (i->red)
+      n += plane;
+   if (i->plotk)
+      n += plane;
+   if (i->plotw)
+      n += plane;
+   if (i->etag)
+      n += strlen (i->etag) + 1;
+   if (i->modified)
+      n += strlen (i->modified) + 1;
+   return n;
+}
+
+static void
+file_evict (file_t * i)
+{                               // Free content, keeping validators, negative cache, and back off (image_mutex held, and not the current image)
+   free (i->data);
+   i->data = NULL;
+   free (i->bits);
+   i->bits = NULL;
+   free (i->mask);
+   i->mask = NULL;
+   free (i->red);
+   i->red = NULL;
+   free (i->plotk);
+   i->plotk = NULL;
+   free (i->plotw);
+   i->plotw = NULL;
+   i->plot = 0;
+   i->card = 0;                 // Can load from card again
+}
+
+static void
+file_free (file_t * i)
+{                               // Remove file completely (image_mutex held, and not the current image)
+   file_t **p;
+   for (p = &files; *p && *p != i; p = &(*p)->next);
+   if (*p)
+      *p = i->next;
+   for (p = file_bucket (i->url); *p && *p != i; p = &(*p)->hnext);
+   if (*p)
+      *p = i->hnext;
+   file_evict (i);
+   free (i->url);
+   free (i->etag);
+   free (i->modified);
+   free (i);
+}
+
+void
+cache_trim (void)
+{                               // Free content of least recently used files to stay within memory budget
+   xSemaphoreTake (image_mutex, portMAX_DELAY);
+   while (1)
+   {
+      uint32_t total = 0;
+      file_t *lru = NULL,       // Oldest with content
+         *old = NULL;           // Oldest
+      for (file_t * i = files; i; i = i->next)
+      {
+         total += file_bytes (i);
+         if (i == image)
+            continue;
+         if ((i->bits || i->data) && (!lru || i->used < lru->used))
+            lru = i;
+         if (!old || i->used < old->used)
+            old = i;
+      }
+      cachebytes = total;
+      if (!old || !imagecache || total <= imagecache)
+         break;
+      if (lru)
+      {
+         ESP_LOGE (TAG, "Evict %s", lru->url);
+         file_evict (lru);
+      } else
+      {                         // Only entries left, which are small, so this is a tiny budget
+         ESP_LOGE (TAG, "Drop %s", old->url);
+         file_free (old);
+      }
+      cacheevicted++;
+   }
+   xSemaphoreGive (image_mutex);
+}
+
+void
+prerender (file_t * i)
+{                               // Make black and white pixel planes for current plot mode, so redraw is just a blit
+   i->plot = 0;
+   if (!i->bits)
+      return;
+   uint32_t words = i->line * i->h / sizeof (uint32_t);
+   if (!i->plotk)
+      i->plotk = mallocspi (words * sizeof (uint32_t));
+   if (!i->plotw)
+      i->plotw = mallocspi (words * sizeof (uint32_t));
+   if (!i->plotk || !i->plotw)
+   {
+      free (i->plotk);
+      i->plotk = NULL;
+      free (i->plotw);
+      i->plotw = NULL;
+      return;
+   }
+   const uint32_t *b = (const uint32_t *) i->bits;
+   const uint32_t *m = (const uint32_t *) i->mask;
+   const uint32_t *r = (const uint32_t *) i->red;
+   uint32_t *k = (uint32_t *) i->plotk;
+   uint32_t *w = (uint32_t *) i->plotw;
+   // Set pixels are plotted in gfx_colour, clear in gfx_background, hence the odd looking mask modes
+   // Red stays red in normal and invert, so is left out of black and white, mask modes are one colour so red is not drawn
+   i->plotr = 0;
+   switch (imageplot)
+   {
+   case REVK_SETTINGS_IMAGEPLOT_NORMAL:
+      for (uint32_t n = 0; n < words; n++)
+      {
+         k[n] = (m[n] & b[n] & (r ? ~r[n] : ~0));
+         w[n] = (m[n] & ~b[n]);
+      }
+      i->plotr = (r ? 1 : 0);
+      break;
+   case REVK_SETTINGS_IMAGEPLOT_INVERT:
+      for (uint32_t n = 0; n < words; n++)
+      {
+         k[n] = (m[n] & ~b[n]);
+         w[n] = (m[n] & b[n] & (r ? ~r[n] : ~0));
+      }
+      i->plotr = (r ? 1 : 0);
+      break;
+   case REVK_SETTINGS_IMAGEPLOT_MASK:
+      memcpy (k, m, words * sizeof (uint32_t));
+      memset (w, 0, words * sizeof (uint32_t));
+      break;
+   default:
+      memset (k, 0, words * sizeof (uint32_t));
+      memcpy (w, m, words * sizeof (uint32_t));
+      break;
+   }
+   i->plot = imageplot + 1;
+}
+
+void
+check_file (file_t * i)
+{
+   if (!i || !i->size)
+      return;
+   i->changed = time (0);
+   if (i->bits)
+   {
+      i->json = 0;              // PNG or native
+      i->new = 1;
+      prerender (i);
+      ESP_LOGE (TAG, "Image %s len %lu width %lu height %lu", i->url, i->size, i->w, i->h);
+   } else if (i->data)
+   {                            // Not a png
+      jo_t j = jo_parse_mem (i->data, i->size);
+      jo_skip (j);
+      const char *e = jo_error (j, NULL);
+      jo_free (&j);
+      if (!e)
+      {                         // Valid JSON
+         i->json = 1;
+         i->new = 1;
+         i->w = i->h = 0;
+         ESP_LOGE (TAG, "JSON %s len %lu", i->url, i->size);
+      } else
+      {                         // Not sensible
+         free (i->data);
+         i->data = NULL;
+         i->size = 0;
+         i->hash = 0;
+         i->w = i->h = 0;
+         i->changed = 0;
+         ESP_LOGE (TAG, "Unknown %s error %s", i->url, e);
+      }
+   }
+}
+
+// Stream decode, data is fed as it arrives, PNG is decoded directly to the image bitmap
+// Native format is EPD, flags, width (2 bytes, MSB first), height (2 bytes), then rows of 1 bit per pixel, bit 7 left, 1 is white
+// Red plane follows black if flagged, and data is PackBits compressed if flagged
+// A headerless file the size of the display (or twice, with red) is taken as native as well
+
+static const uint8_t pngsig[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+static const uint8_t nativesig[] = { 'E', 'P', 'D' };
+
+#define	NATIVE_RLE	0x01    // PackBits compressed
+#define	NATIVE_RED	0x02    // Red plane follows black plane
+
+typedef struct stream_s
+{
+   file_t *i;                   // File being received
+   FILE *save;                  // Also write data here, if set
+   planes_t p;                  // New image
+   lwpng_t *png;                // PNG decoder
+   FILE *o;                     // Memory stream for non PNG
+   char *buf;                   // Memory stream buffer
+   size_t len;                  // Memory stream length
+   const char *error;           // Error
+   uint32_t size;               // Bytes received
+   uint32_t hash;               // Running CRC32
+   uint32_t decodeus;           // Time decoding
+   uint32_t saveus;             // Time writing save
+   uint32_t fline;              // Native bytes per row
+   uint32_t fh;                 // Native rows
+   uint32_t fx;                 // Native byte in row
+   uint32_t fy;                 // Native row
+   uint8_t plane;               // Native plane
+   uint8_t planes;              // Native planes
+   uint8_t lit;                 // PackBits literal bytes to follow
+   uint8_t rep;                 // PackBits repeat for next byte
+   uint8_t head[sizeof (pngsig)];       // Start of file
+   uint8_t headlen;             // Bytes in head
+   uint8_t savefail:1;          // Write to save failed
+   uint8_t native:1;            // Native format
+   uint8_t rle:1;               // Native is PackBits
+} stream_t;
+
+static void *
+my_alloc (void *opaque, uInt items, uInt size)
+{
+   return mallocspi (items * size);
+}
+
+static void
+my_free (void *opaque, void *address)
+{
+   free (address);
+}
+
+static const char *
+header (void *opaque, uint32_t w, uint32_t h, uint8_t depth, uint8_t colour)
+{
+   stream_t *s = opaque;
+   if (w > gfx_width ())
+      w = gfx_width ();
+   if (h > gfx_height ())
+      h = gfx_height ();
+   s->p.w = w;
+   s->p.h = h;
+   s->p.line = (w + 31) / 32 * 4;      // Whole words so planes can be processed a word at a time
+   if (!s->p.line || !h)
+      return "No image";
+   s->p.bits = mallocspi (s->p.line * h);
+   s->p.mask = mallocspi (s->p.line * h);
+   if (!s->p.bits || !s->p.mask)
+      return "No memory";
+   memset (s->p.bits, 0, s->p.line * h);
+   memset (s->p.mask, 0, s->p.line * h);
+   return NULL;
+}
+
+static const char *
+pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{
+   planes_t *p = &((stream_t *) opaque)->p;
+   if (x >= p->w || y >= p->h || !(a & 0x8000))
+      return NULL;
+   uint32_t o = y * p->line + x / 8;
+   uint8_t m = (0x80 >> (x & 7));
+   p->mask[o] |= m;
+#ifdef	PLANES_RED
+   switch (planes_inkof (r, g, b))
+   {
+   case INK_WHITE:
+      p->bits[o] |= m;
+      break;
+   case INK_RED:
+      if (!p->red)
+      {                         // First red pixel
+         p->red = mallocspi (p->line * p->h);
+         if (!p->red)
+            return "No memory";
+         memset (p->red, 0, p->line * p->h);
+      }
+      p->bits[o] |= m;          // White under red
+      p->red[o] |= m;
+      break;
+   }
+#else
+   if (g & 0x8000)
+      p->bits[o] |= m;
+#endif
+   return NULL;
+}
+
+static const char *
+native_start (stream_t * s)
+{                               // Native header is in head
+   uint32_t w = (s->head[4] << 8) + s->head[5],
+      h = (s->head[6] << 8) + s->head[7];
+   s->native = 1;
+   s->rle = ((s->head[3] & NATIVE_RLE) ? 1 : 0);
+   s->planes = ((s->head[3] & NATIVE_RED) ? 2 : 1);
+   s->fline = (w + 7) / 8;
+   s->fh = h;
+   const char *e = header (s, w, h, 1, 0);
+   if (e)
+      return e;
+   if (s->planes > 1)
+   {
+      s->p.red = mallocspi (s->p.line * s->p.h);
+      if (!s->p.red)
+         return "No memory";
+      memset (s->p.red, 0, s->p.line * s->p.h);
+   }
+   for (uint32_t y = 0; y < s->p.h; y++)
+   {                            // All opaque
+      uint8_t *m = s->p.mask + y * s->p.line;
+      memset (m, 0xFF, s->p.w / 8);
+      if (s->p.w & 7)
+         m[s->p.w / 8] = (0xFF << (8 - (s->p.w & 7)));
+   }
+   return NULL;
+}
+
+static void
+native_out (stream_t * s, const uint8_t * data, uint8_t fill, size_t len)
+{                               // Store bytes from data (or fill if NULL) a row at a time, clipping to display
+   while (len)
+   {
+      if (s->plane >= s->planes)
+      {
+         s->error = "Too much data";
+         return;
+      }
+      size_t n = s->fline - s->fx;
+      if (n > len)
+         n = len;
+      if (s->fy < s->p.h && s->fx < s->p.line)
+      {
+         size_t c = s->p.line - s->fx;
+         if (c > n)
+            c = n;
+         uint8_t *p = (s->plane ? s->p.red : s->p.bits) + s->fy * s->p.line + s->fx;
+         if (data)
+            memcpy (p, data, c);
+         else
+            memset (p, fill, c);
+      }
+      if (data)
+         data += n;
+      len -= n;
+      s->fx += n;
+      if (s->fx == s->fline)
+      {
+         s->fx = 0;
+         if (++s->fy == s->fh)
+         {
+            s->fy = 0;
+            s->plane++;
+         }
+      }
+   }
+}
+
+static void
+native_feed (stream_t * s, size_t len, const uint8_t * data)
+{
+   if (!s->rle)
+   {
+      native_out (s, data, 0, len);
+      return;
+   }
+   while (len && !s->error)
+   {
+      if (s->lit)
+      {                         // Literal bytes
+         size_t n = s->lit;
+         if (n > len)
+            n = len;
+         native_out (s, data, 0, n);
+         data += n;
+         len -= n;
+         s->lit -= n;
+      } else if (s->rep)
+      {                         // Repeated byte
+         native_out (s, NULL, *data++, s->rep);
+         len--;
+         s->rep = 0;
+      } else
+      {                         // PackBits header byte
+         uint8_t c = *data++;
+         len--;
+         if (c < 128)
+            s->lit = c + 1;
+         else if (c > 128)
+            s->rep = 257 - c;
       }
    }
-   return i;
 }
 
-void
-check_file (file_t * i)
-{
-   if (!i || !i->data || !i->size)
+static void
+native_end (stream_t * s)
+{
+   if (s->plane < s->planes || s->lit || s->rep)
+   {
+      s->error = "Too short";
+      return;
+   }
+   uint32_t words = s->p.line * s->p.h / sizeof (uint32_t);
+   const uint32_t *m = (const uint32_t *) s->p.mask;
+   uint32_t *b = (uint32_t *) s->p.bits;
+   uint32_t *r = (uint32_t *) s->p.red;
+   for (uint32_t n = 0; n < words; n++)
+   {                            // Lose padding bits
+      b[n] &= m[n];
+      if (r)
+         r[n] &= m[n];
+   }
+}
+
+void
+stream_start (stream_t * s, file_t * i)
+{
+   memset (s, 0, sizeof (*s));
+   s->i = i;
+}
+
+static void
+stream_feed (stream_t * s, size_t len, const uint8_t * data)
+{                               // Pass data to decoder or memory stream
+   int64_t start = esp_timer_get_time ();
+   if (s->png)
+   {
+      const char *e = lwpng_data (s->png, len, data);
+      if (e)
+         s->error = e;
+   } else if (s->native)
+      native_feed (s, len, data);
+   else if (s->o)
+      fwrite (data, len, 1, s->o);
+   s->decodeus += esp_timer_get_time () - start;
+}
+
+void
+stream_data (stream_t * s, size_t len, const uint8_t * data)
+{
+   if (!len || s->error)
+      return;
+   s->hash = esp_rom_crc32_le (s->hash, data, len);
+   s->size += len;
+   if (s->save)
+   {
+      int64_t start = esp_timer_get_time ();
+      if (fwrite (data, len, 1, s->save) != 1)
+      {
+         fclose (s->save);
+         s->save = NULL;
+         s->savefail = 1;
+      }
+      s->saveus += esp_timer_get_time () - start;
+   }
+   if (s->headlen < sizeof (s->head))
+   {                            // Need start of file to decide what it is
+      size_t l = sizeof (s->head) - s->headlen;
+      if (l > len)
+         l = len;
+      memcpy (s->head + s->headlen, data, l);
+      s->headlen += l;
+      data += l;
+      len -= l;
+      if (s->headlen < sizeof (s->head))
+         return;
+      if (!memcmp (s->head, pngsig, sizeof (pngsig)))
+      {
+#ifdef	PLANES_RED
+         planes_ink ();
+#endif
+         s->png = lwpng_init (s, &header, &pixel, &my_alloc, &my_free, NULL);
+         if (!s->png)
+            s->error = "No memory";
+      } else if (!memcmp (s->head, nativesig, sizeof (nativesig)))
+         s->error = native_start (s);
+      else
+      {
+         s->o = open_memstream (&s->buf, &s->len);
+         if (!s->o)
+            s->error = "No memory";
+      }
+      if (s->error)
+         return;
+      if (!s->native)
+         stream_feed (s, s->headlen, s->head);
+   }
+   if (len && !s->error)
+      stream_feed (s, len, data);
+}
+
+void
+stream_free (stream_t * s)
+{
+   if (s->png)
+      lwpng_end (&s->png);
+   if (s->o)
+   {
+      fclose (s->o);
+      s->o = NULL;
+   }
+   free (s->buf);
+   s->buf = NULL;
+   free (s->p.bits);
+   s->p.bits = NULL;
+   free (s->p.mask);
+   s->p.mask = NULL;
+   free (s->p.red);
+   s->p.red = NULL;
+}
+
+int
+stream_end (stream_t * s)
+{                               // End of data, returns 1 if file changed, 0 if same, -1 if failed
+   file_t *i = s->i;
+   if (s->png)
+   {
+      const char *e = lwpng_end (&s->png);
+      if (e && !s->error)
+         s->error = e;
+      if (!s->error && !s->p.bits)
+         s->error = "No image";
+   } else if (s->o)
+   {
+      fclose (s->o);
+      s->o = NULL;
+      uint32_t raw = (gfx_width () + 7) / 8 * gfx_height ();
+      if (!s->buf)
+         s->error = "No memory";
+      else if (raw && (s->len == raw || s->len == raw * 2))
+      {                         // Headerless native, i.e. the frame buffer
+         s->head[3] = (s->len > raw ? NATIVE_RED : 0);
+         s->head[4] = (gfx_width () >> 8);
+         s->head[5] = gfx_width ();
+         s->head[6] = (gfx_height () >> 8);
+         s->head[7] = gfx_height ();
+         s->error = native_start (s);
+         int64_t start = esp_timer_get_time ();
+         if (!s->error)
+            native_feed (s, s->len, (uint8_t *) s->buf);
+         s->decodeus += esp_timer_get_time () - start;
+         free (s->buf);
+         s->buf = NULL;
+      }
+   } else if (!s->native && !s->error)
+      s->error = "Too short";
+   if (s->native && !s->error)
+      native_end (s);
+   if (s->saveus)
+      perf_add (PERF_SDWRITE, s->saveus);
+   if (s->error)
+   {
+      ESP_LOGE (TAG, "Failed %s len %lu error %s", i->url, s->size, s->error);
+      stream_free (s);
+      return -1;
+   }
+   perf_add (PERF_DECODE, s->decodeus);
+   if ((i->bits || i->data) && i->size == s->size && i->hash == s->hash)
+   {                            // Same as we have
+      stream_free (s);
+      return 0;
+   }
+   xSemaphoreTake (image_mutex, portMAX_DELAY);
+   free (i->data);
+   i->data = (uint8_t *) s->buf;
+   s->buf = NULL;
+   free (i->bits);
+   i->bits = s->p.bits;
+   s->p.bits = NULL;
+   free (i->mask);
+   i->mask = s->p.mask;
+   s->p.mask = NULL;
+   free (i->red);
+   i->red = s->p.red;
+   s->p.red = NULL;
+   free (i->plotk);
+   i->plotk = NULL;
+   free (i->plotw);
+   i->plotw = NULL;
+   i->plot = 0;
+   i->size = s->size;
+   i->hash = s->hash;
+   i->w = s->p.w;
+   i->h = s->p.h;
+   i->line = s->p.line;
+   i->native = s->native;
+   int64_t start = esp_timer_get_time ();
+   check_file (i);
+   perf_since (PERF_CHECK, start);
+   xSemaphoreGive (image_mutex);
+   stream_free (s);
+   return (i->bits || i->data) ? 1 : -1;
+}
+
+// Patch, a 226 response to our A-IM: epd-patch request, replaces rectangles of a native image
+// EPDP, hash patched, hash after, size after (4 bytes each, MSB first), then rectangles
+// Rectangle is plane, x byte, y, width bytes, height (2 bytes each, MSB first, plane is 1 byte), then rows of data
+
+static const uint8_t patchsig[] = { 'E', 'P', 'D', 'P' };
+
+#define	PATCHHEAD	(sizeof (patchsig) + 12)
+#define	PATCHRECT	9
+
+static inline uint32_t
+be16 (const uint8_t * p)
+{
+   return (p[0] << 8) + p[1];
+}
+
+static inline uint32_t
+be32 (const uint8_t * p)
+{
+   return (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+const char *
+patch_apply (file_t * i, const uint8_t * p, size_t len)
+{                               // Apply patch to image in place, returns error or NULL
+   if (!i->native || !i->bits)
+      return "Not native";
+   if (len < PATCHHEAD || memcmp (p, patchsig, sizeof (patchsig)))
+      return "Not a patch";
+   if (be32 (p + 4) != i->hash)
+      return "Wrong image";
+   const uint8_t *e = p + len;
+   for (const uint8_t *r = p + PATCHHEAD; r < e; r += PATCHRECT + be16 (r + 5) * be16 (r + 7))
+   {                            // Check all fits before we change anything
+      if (e - r < PATCHRECT || e - r - PATCHRECT < be16 (r + 5) * be16 (r + 7))
+         return "Truncated";
+      if (r[0] > 1 || (r[0] && !i->red))
+         return "Bad plane";
+   }
+   xSemaphoreTake (image_mutex, portMAX_DELAY);
+   for (const uint8_t *r = p + PATCHHEAD; r < e; r += PATCHRECT + be16 (r + 5) * be16 (r + 7))
+   {
+      uint32_t x = be16 (r + 1),
+         y = be16 (r + 3),
+         w = be16 (r + 5),
+         h = be16 (r + 7);
+      uint8_t *plane = (r[0] ? i->red : i->bits);
+      uint32_t c = (x < i->line ? i->line - x : 0);     // Bytes of each row we keep
+      if (c > w)
+         c = w;
+      for (uint32_t n = 0; n < h && y + n < i->h && c; n++)
+      {
+         uint8_t *d = plane + (y + n) * i->line + x;
+         const uint8_t *m = i->mask + (y + n) * i->line + x;
+         memcpy (d, r + PATCHRECT + n * w, c);
+         for (uint32_t b = 0; b < c; b++)
+            d[b] &= m[b];       // Lose padding bits
+      }
+   }
+   i->hash = be32 (p + 8);
+   i->size = be32 (p + 12);
+   check_file (i);
+   xSemaphoreGive (image_mutex);
+   return NULL;
+}
+
+// SD card copies are named by URL hash, written to a temp file and renamed, so a power cut cannot leave a torn file, or no file
+// The .inf sidecar has size, hash, and changed time of the file, and the server's size and hash, then ETag and Last-Modified, so we can revalidate after a restart
+// The server's size and hash differ from the file's for a native copy saved after a patch, and are what patches are made against
+
+char *
+card_file (const char *url, const char *ext)
+{                               // Name of file on SD card for URL (malloc'd)
+   char *fn = NULL;
+   asprintf (&fn, "%s/%08lX.%s", sd_mount, esp_rom_crc32_le (0, (const uint8_t *) url, strlen (url)), ext);
+   return fn;
+}
+
+FILE *
+card_create (const char *url)
+{                               // Temp file to write
+   char *tmp = card_file (url, "tmp");
+   FILE *f = (tmp ? fopen (tmp, "w") : NULL);
+   free (tmp);
+   return f;
+}
+
+static char *
+card_old (const char *url, const char *ext)
+{                               // Name old file is kept as while being replaced
+   char old[4] = { ext[0], ext[1], '~' };
+   return card_file (url, old);
+}
+
+int
+card_commit (const char *url, const char *ext, int ok)
+{                               // Replace file with temp file if ok, else discard it, returns 0 if replaced
+   char *tmp = card_file (url, "tmp"),
+      *fn = card_file (url, ext),
+      *old = card_old (url, ext);
+   int e = (!ok || !tmp || !fn || !old);
+   if (!e)
+   {                            // FAT rename does not replace, so move old file aside until the new one is in place
+      unlink (old);
+      rename (fn, old);
+      e = rename (tmp, fn);
+      if (e)
+         rename (old, fn);
+      else
+         unlink (old);
+   }
+   if (e && tmp)
+      unlink (tmp);
+   free (tmp);
+   free (fn);
+   free (old);
+   return e;
+}
+
+FILE *
+card_open (const char *url, const char *ext)
+{                               // Open file to read, or the old file if power was lost while replacing it
+   char *fn = card_file (url, ext);
+   if (!fn)
+      return NULL;
+   FILE *f = fopen (fn, "r");
+   if (!f)
+   {
+      char *old = card_old (url, ext);
+      if (old && !rename (old, fn))
+         f = fopen (fn, "r");
+      free (old);
+   }
+   free (fn);
+   return f;
+}
+
+void
+card_meta_save (file_t * i)
+{                               // Write sidecar
+   FILE *f = card_create (i->url);
+   if (!f)
+      return;
+   int ok = (fprintf (f, "%lu %08lX %lld %lu %08lX\n%s\n%s\n", i->cardsize, i->cardhash, (long long) i->changed, i->size,
+                      i->hash, i->etag ? : "", i->modified ? : "") > 0);
+   if (fclose (f))
+      ok = 0;
+   if (card_commit (i->url, "inf", ok))
+      ESP_LOGE (TAG, "Sidecar failed %s", i->url);
+}
+
+void
+card_meta_load (file_t * i)
+{                               // Read sidecar, using it if it is for the file we have loaded
+   FILE *f = card_open (i->url, "inf");
+   if (!f)
+      return;
+   char line[3][256];
+   unsigned long size = 0,
+      hash = 0,
+      ssize = 0,
+      shash = 0;
+   long long changed = 0;
+   int n;
+   for (n = 0; n < 3 && fgets (line[n], sizeof (line[n]), f); n++)
+   {
+      char *e = line[n] + strlen (line[n]);
+      while (e > line[n] && (e[-1] == '\n' || e[-1] == '\r'))
+         *--e = 0;
+   }
+   fclose (f);
+   if (n < 3 || sscanf (line[0], "%lu %lX %lld %lu %lX", &size, &hash, &changed, &ssize, &shash) < 3 || size != i->cardsize
+       || hash != i->cardhash)
+      return;
+   if (ssize)
+   {                            // Server's size and hash, not the same as the card file if we saved it after a patch
+      i->size = ssize;
+      i->hash = shash;
+   }
+   i->changed = changed;
+   free (i->etag);
+   i->etag = (*line[1] ? strdup (line[1]) : NULL);
+   free (i->modified);
+   i->modified = (*line[2] ? strdup (line[2]) : NULL);
+}
+
+int
+native_save (file_t * i)
+{                               // Write image to SD as a native file, e.g. after patching, returns 0 if OK
+   FILE *f = card_create (i->url);
+   if (!f)
+      return -1;
+   uint32_t fline = (i->w + 7) / 8;
+   uint8_t head[8] = { 'E', 'P', 'D', i->red ? NATIVE_RED : 0, i->w >> 8, i->w, i->h >> 8, i->h };
+   uint32_t hash = esp_rom_crc32_le (0, head, sizeof (head)),
+      size = sizeof (head);
+   int ok = (fwrite (head, sizeof (head), 1, f) == 1);
+   for (int plane = 0; ok && plane < (i->red ? 2 : 1); plane++)
+      for (uint32_t y = 0; ok && y < i->h; y++)
+      {
+         const uint8_t *r = (plane ? i->red : i->bits) + y * i->line;
+         ok = (fwrite (r, fline, 1, f) == 1);
+         hash = esp_rom_crc32_le (hash, r, fline);
+         size += fline;
+      }
+   if (fclose (f))
+      ok = 0;
+   if (card_commit (i->url, "img", ok))
+      return -1;
+   i->cardsize = size;
+   i->cardhash = hash;
+   return 0;
+}
+
+// HTTP clients, kept per host so the connection, and TLS session, can be reused
+
+typedef struct host_s
+{
+   struct host_s *next;         // Next host in chain
+   char *host;                  // Scheme, host and port from URL
+   esp_http_client_handle_t client;     // Client
+   uint32_t requests;           // Requests made
+   uint32_t handshakes;         // Connections made
+   uint64_t handshaketime;      // Total time making connections (us)
+   char *etag;                  // ETag from this response
+   char *modified;              // Last-Modified from this response
+   int32_t maxage;              // Cache-Control max-age from this response, -1 if none
+   int32_t expires;             // Expires (seconds from now) from this response, -1 if none
+   int32_t retry;               // Retry-After from this response, -1 if none
+   uint8_t connected:1;         // Connected during this request
+   uint8_t kept:1;              // Connection left open after last request
+} host_t;
+
+host_t *hosts = NULL;           // Owned by fetch task
+
+static esp_err_t
+http_event (esp_http_client_event_t * e)
+{
+   host_t *h = e->user_data;
+   if (!h)
+      return ESP_OK;
+   if (e->event_id == HTTP_EVENT_ON_CONNECTED)
+      h->connected = 1;
+   else if (e->event_id == HTTP_EVENT_ON_HEADER && e->header_key && e->header_value)
+   {
+      const char *v = e->header_value;
+      if (!strcasecmp (e->header_key, "ETag"))
+      {
+         free (h->etag);
+         h->etag = strdup (v);
+      } else if (!strcasecmp (e->header_key, "Last-Modified"))
+      {
+         free (h->modified);
+         h->modified = strdup (v);
+      } else if (!strcasecmp (e->header_key, "Cache-Control"))
+      {
+         const char *a = strcasestr (v, "max-age=");
+         if (a)
+            h->maxage = atoi (a + 8);
+         else if (strcasestr (v, "no-cache") || strcasestr (v, "no-store"))
+            h->maxage = 0;
+      } else if (!strcasecmp (e->header_key, "Expires"))
+      {
+         time_t t = parse_http_time (v);
+         time_t now = time (0);
+         h->expires = (t > now ? t - now : 0);
+      } else if (!strcasecmp (e->header_key, "Retry-After"))
+      {
+         if (isdigit ((int) (uint8_t) * v))
+            h->retry = atoi (v);
+         else
+         {
+            time_t t = parse_http_time (v);
+            time_t now = time (0);
+            if (t > now)
+               h->retry = t - now;
+         }
+      }
+   }
+   return ESP_OK;
+}
+
+host_t *
+find_host (const char *url)
+{
+   const char *e = strstr (url, "//");
+   if (e)
+      e = strchr (e + 2, '/');
+   size_t l = (e ? e - url : strlen (url));
+   host_t *h;
+   for (h = hosts; h && (strlen (h->host) != l || strncasecmp (h->host, url, l)); h = h->next);
+   if (!h)
+   {
+      h = mallocspi (sizeof (*h));
+      if (!h)
+         return h;
+      memset (h, 0, sizeof (*h));
+      h->host = strndup (url, l);
+      h->next = hosts;
+      hosts = h;
+   }
+   if (!h->client)
+   {
+      esp_http_client_config_t config = {
+         .url = url,
+         .crt_bundle_attach = esp_crt_bundle_attach,
+         .timeout_ms = 20000,
+         .keep_alive_enable = true,
+         .event_handler = http_event,
+         .user_data = h,
+#ifdef	CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+         .save_client_session = true,
+#endif
+      };
+      h->client = esp_http_client_init (&config);
+   }
+   return h;
+}
+
+void
+host_connected (host_t * h, uint64_t us)
+{                               // New connection (and TLS handshake if https) was made
+   h->handshakes++;
+   h->handshaketime += us;
+   ESP_LOGE (TAG, "Connect %s %llums", h->host, us / 1000ULL);
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "host", h->host);
+   jo_int (j, "handshakes", h->handshakes);
+   jo_int (j, "requests", h->requests);
+   jo_int (j, "ms", us / 1000ULL);
+   jo_int (j, "totalms", h->handshaketime / 1000ULL);
+   revk_info ("http", &j);
+}
+
+uint32_t fetchjitter = 0;       // Per device offset for checks
+
+uint32_t
+next_check (file_t * i, int response, int32_t hint)
+{                               // Seconds until file should be checked again
+   uint32_t period = (recheck ? : 60);
+   uint32_t wait = period;
+   if (response == 404)
+   {                            // Missing, e.g. no seasonal variant, no need to keep asking
+      i->fails = 0;
+      if (missing > wait)
+         wait = missing;
+   } else if (response == 200 || response == 304 || !response)
+      i->fails = 0;
+   else
+   {                            // Back off on errors
+      if (i->fails < 16)
+         i->fails++;
+      uint64_t w = (uint64_t) period << (i->fails - 1);
+      if (w > BACKOFFMAX)
+         w = (period > BACKOFFMAX ? period : BACKOFFMAX);
+      wait = w;
+   }
+   if (hint > (int32_t) wait)
+      wait = (hint > CACHEMAX ? CACHEMAX : hint);
+   // Check at this device's slot in the period, so a building full of signs do not all ask at once
+   uint32_t offset = fetchjitter % period;
+   time_t now = time (0);
+   if (now < 1000000000)
+      return wait + offset;
+   time_t base = now + wait - period;
+   time_t next = (base - offset) / period * period + period + offset;   // First slot after base
+   return next - now;
+}
+
+int
+card_load (file_t * i)
+{                               // Load file from card, returns as stream_end
+   FILE *f = card_open (i->url, "img");
+   if (!f)
+      return -1;
+   int r = -1;
+   int64_t start = esp_timer_get_time ();
+   uint8_t *buf = malloc (CARDCHUNK);
+   if (buf)
+   {                            // Decode as read, so memory needed does not depend on file size
+      stream_t s;
+      stream_start (&s, i);
+      size_t l;
+      while ((l = fread (buf, 1, CARDCHUNK, f)) > 0 && !s.error)
+         stream_data (&s, l, buf);
+      if (ferror (f))
+         s.error = "Read failed";
+      r = stream_end (&s);      // Compares by size and hash
+      free (buf);
+   }
+   fclose (f);
+   perf_since (PERF_SDREAD, start);
+   if (r >= 0)
+   {
+      i->cardsize = i->size;
+      i->cardhash = i->hash;
+      card_meta_load (i);
+   }
+   return r;
+}
+
+static int
+strdiff (const char *a, const char *b)
+{
+   return (a && b) ? strcmp (a, b) : a != b;
+}
+
+file_t *
+download (char *url)
+{
+   file_t *i = find_file (url);
+   if (!i)
+      return i;
+   url = strdup (i->url);       // Use as is
+   ESP_LOGD (TAG, "Get %s", url);
+   if (card && !i->card && !i->bits && !i->data)
+   {                            // Load from card first, so we can revalidate what we have
+      i->card = 1;              // card tried, no need to try again
+      if (card_load (i) > 0)
+      {
+         ESP_LOGE (TAG, "Read %s", url);
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "read", url);
+         if (i->etag)
+            jo_string (j, "etag", i->etag);
+         revk_info ("SD", &j);
+      }
+   }
+   if (i->size && !i->bits && !i->data)
+   {                            // Content evicted, and not on card, so validators are no use, fetch it again now
+      free (i->etag);
+      i->etag = NULL;
+      free (i->modified);
+      i->modified = NULL;
+      i->changed = 0;
+      i->native = 0;
+      i->size = 0;
+      i->hash = 0;
+      i->cache = 0;
+   }
+   uint8_t meta = 0;            // Sidecar needs writing
+   int32_t len = 0;
+   int response = -1;
+   if (i->cache > uptime ())
+      response = (i->bits || i->data ? 304 : 404);      // Cached
+   else if (!revk_link_down () && (!strncasecmp (url, "http://", 7) || !strncasecmp (url, "https://", 8)))
+   {
+      int32_t hint = -1;
+      host_t *h = find_host (url);
+      esp_http_client_handle_t client = (h ? h->client : NULL);
+      if (client)
+      {
+         esp_http_client_set_url (client, url);
+         free (h->etag);
+         h->etag = NULL;
+         free (h->modified);
+         h->modified = NULL;
+         h->maxage = h->expires = h->retry = -1;
+         if (i->etag)
+            esp_http_client_set_header (client, "If-None-Match", i->etag);
+         else
+            esp_http_client_delete_header (client, "If-None-Match");
+         if (i->modified)
+            esp_http_client_set_header (client, "If-Modified-Since", i->modified);
+         else if (i->changed && !i->etag)
+         {                      // Server gave no validator, so best guess
+            char when[50];
+            struct tm t;
+            gmtime_r (&i->changed, &t);
+            strftime (when, sizeof (when), "%a, %d %b %Y %T GMT", &t);
+            esp_http_client_set_header (client, "If-Modified-Since", when);
+         } else
+            esp_http_client_delete_header (client, "If-Modified-Since");
+         if (i->native && i->bits)
+         {                      // Server can send a patch against what we have
+            char hash[20];
+            sprintf (hash, "%08lX", i->hash);
+            esp_http_client_set_header (client, "A-IM", "epd-patch");
+            esp_http_client_set_header (client, "X-Image-Hash", hash);
+         } else
+         {
+            esp_http_client_delete_header (client, "A-IM");
+            esp_http_client_delete_header (client, "X-Image-Hash");
+         }
+         uint8_t valid = 0;
+         esp_err_t err = ESP_FAIL;
+         for (int try = 0; try < 2; try++)
+         {                      // Second try if a kept connection turns out to have been closed by the server
+            h->connected = 0;
+            int64_t start = esp_timer_get_time ();
+            err = esp_http_client_open (client, 0);
+            int64_t opened = esp_timer_get_time ();
+            if (!err)
+            {
+               perf_add (PERF_CONNECT, opened - start);
+               len = esp_http_client_fetch_headers (client);
+               if (len >= 0)
+                  perf_since (PERF_HEADERS, opened);
+            }
+            if (h->connected)
+               host_connected (h, esp_timer_get_time () - start);
+            if (!err && len >= 0)
+               break;
+            esp_http_client_close (client);
+            if (!err)
+               err = ESP_FAIL;
+            if (!h->kept || h->connected)
+               break;           // Was a new connection, so no point trying again
+            h->kept = 0;
+         }
+         h->kept = 0;
+         if (!err)
+         {
+            h->requests++;
+            ESP_LOGD (TAG, "%s Len %ld", url, len);
+            response = esp_http_client_get_status_code (client);
+            if (response == 200)
+            {                   // Decode as it arrives
+               stream_t s;
+               stream_start (&s, i);
+               if (card)
+                  s.save = card_create (url);
+               const int max = 1024;
+               uint8_t *buf = malloc (max);
+               if (buf)
+               {
+                  int64_t start = esp_timer_get_time ();
+                  int l;
+                  while ((l = esp_http_client_read (client, (char *) buf, max)) > 0)
+                     stream_data (&s, l, buf);
+                  free (buf);
+                  perf_since (PERF_BODY, start);
+                  perf_add (PERF_BYTES, s.size);
+                  if (l < 0)
+                  {
+                     len = l;
+                     s.error = "Read failed";
+                  } else if (len > 0 && len != s.size)
+                     s.error = "Short";
+                  else
+                     len = s.size;
+               } else
+                  s.error = "No memory";
+               uint8_t saved = (s.save ? 1 : 0);
+               if (s.save && fclose (s.save))
+                  s.savefail = 1;
+               s.save = NULL;
+               int r = stream_end (&s);
+               if (saved && !card_commit (url, "img", r > 0 && !s.savefail))
+               {
+                  i->cardsize = i->size;
+                  i->cardhash = i->hash;
+                  meta = 1;
+                  jo_t j = jo_object_alloc ();
+                  jo_string (j, "write", url);
+                  revk_info ("SD", &j);
+                  ESP_LOGE (TAG, "Write %s %lu", url, i->size);
+               }
+               if (!r)
+                  response = 0; // No change
+               valid = (r >= 0);
+            } else if (response == 226)
+            {                   // Patch
+               const char *e = NULL;
+               char *buf = NULL;
+               size_t size = 0;
+               uint32_t total = 0;
+               FILE *o = open_memstream (&buf, &size);
+               if (o)
+               {
+                  char temp[256];
+                  int l = 0;
+                  while (total < i->size && (l = esp_http_client_read (client, temp, sizeof (temp))) > 0)
+                  {
+                     fwrite (temp, l, 1, o);
+                     total += l;
+                  }
+                  if (total >= i->size)
+                     l = 1;     // A patch bigger than the image is pointless
+                  fclose (o);
+                  if (l < 0)
+                     e = "Read failed";
+                  else if (l)
+                     e = "Too big";
+                  else if (buf)
+                     e = patch_apply (i, (uint8_t *) buf, size);
+                  else
+                     e = "No memory";
+                  free (buf);
+               } else
+                  e = "No memory";
+               len = total;
+               if (e)
+               {                // Full download next time
+                  ESP_LOGE (TAG, "Patch failed %s %s", url, e);
+                  i->native = 0;
+               } else
+               {
+                  ESP_LOGE (TAG, "Patched %s %lu", url, total);
+                  response = 200;
+                  valid = 1;
+                  if (card && !native_save (i))
+                     meta = 1;
+               }
+            } else
+            {
+               if (response != 304)
+                  ESP_LOGE (TAG, "Bad response %s (%d)", url, response);
+               else
+                  valid = 1;
+               esp_http_client_flush_response (client, NULL);
+            }
+            if (esp_http_client_is_complete_data_received (client))
+               h->kept = 1;
+            else
+               esp_http_client_close (client);  // Cannot reuse connection
+         }
+         if (valid)
+         {                      // Validators for next time, a 200 replaces them, a 304 may update them
+            if ((response != 304 || h->etag) && strdiff (i->etag, h->etag))
+            {
+               meta = 1;
+               free (i->etag);
+               i->etag = h->etag;
+               h->etag = NULL;
+            }
+            if ((response != 304 || h->modified) && strdiff (i->modified, h->modified))
+            {
+               meta = 1;
+               free (i->modified);
+               i->modified = h->modified;
+               h->modified = NULL;
+            }
+         }
+         // Server can ask us to check less often
+         hint = (valid ? (h->maxage >= 0 ? h->maxage : h->expires) : h->retry);
+      }
+      ESP_LOGD (TAG, "Got %s %d", url, response);
+      i->cache = uptime () + next_check (i, response, hint);
+      if (response != 304 && response != 200 && response)
+      {                         // Failed
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "url", url);
+         if (response != -1)
+            jo_int (j, "response", response);
+         if (len == -ESP_ERR_HTTP_EAGAIN)
+            jo_string (j, "error", "timeout");
+         else if (len)
+            jo_int (j, "len", len);
+         if (i->fails > 1)
+            jo_int (j, "fails", i->fails);
+         revk_error ("image", &j);
+      }
+   }
+   if (meta && card && i->cardsize)
+      card_meta_save (i);
+   free (url);
+   return i;
+}
+
+// Image pushed with the MQTT image command, as an alternative to polling image URL
+// Payload is {"seq":n,"data":"base64"}, seq 0 starting a new image, with "last":true on the final chunk
+
+#define	PUSHIDLE	60      // Abandon a push with no chunk for this long (s)
+#define	PUSHFILE	"pushed"
+
+file_t *volatile pushed = NULL; // Latest pushed image
+static stream_t push;           // Pushed image being received
+static int32_t pushseq = -1;    // Next chunk expected, -1 if none
+static uint32_t pushat = 0;     // Uptime of last chunk
+static uint8_t pushweb = 0;     // Upload in progress
+static SemaphoreHandle_t push_mutex = NULL;     // Held to use push
+
+static file_t *
+push_file (void)
+{
+   if (!pushed)
+   {
+      file_t *i = mallocspi (sizeof (*i));
+      if (!i)
+         return NULL;
+      memset (i, 0, sizeof (*i));
+      i->url = strdup (PUSHFILE);
+      pushed = i;
+   }
+   return pushed;
+}
+
+static const char *
+push_start (stream_t * s)
+{                               // Start receiving a pushed image
+   if (!push_file ())
+      return "No memory";
+   stream_start (s, pushed);
+   if (card)
+      s->save = card_create (PUSHFILE);
+   return NULL;
+}
+
+static int
+push_end (stream_t * s)
+{                               // Finish pushed image, returns as stream_end
+   uint8_t saved = (s->save ? 1 : 0);
+   if (s->save && fclose (s->save))
+      s->savefail = 1;
+   s->save = NULL;
+   int r = stream_end (s);
+   if (saved && !card_commit (PUSHFILE, "img", r >= 0 && !s->savefail))
+   {                            // Sidecar, so when it was pushed survives a restart, as it does for URL images
+      pushed->cardsize = pushed->size;
+      pushed->cardhash = pushed->hash;
+      card_meta_save (pushed);
+   }
+   event_set (EV_FETCH);        // Pick it up
+   return r;
+}
+
+static void
+push_abort (void)
+{
+   if (push.save)
+   {
+      fclose (push.save);
+      push.save = NULL;
+      card_commit (PUSHFILE, "img", 0);
+   }
+   stream_free (&push);
+   pushseq = -1;
+}
+
+static void
+push_idle (void)
+{                               // Abandon a push that has stopped, so its card file and memory are freed
+   if (!push_mutex)
+      return;
+   xSemaphoreTake (push_mutex, portMAX_DELAY);
+   if (pushseq >= 0 && uptime () > pushat + PUSHIDLE)
+   {
+      ESP_LOGE (TAG, "Push abandoned at seq %ld", pushseq);
+      push_abort ();
+   }
+   xSemaphoreGive (push_mutex);
+}
+
+const char *
+image_push (jo_t j)
+{                               // MQTT image command
+   const char *e = NULL;
+   int32_t seq = -1;
+   uint8_t last = 0;
+   uint8_t *data = NULL;
+   ssize_t len = 0;
+   if (!push_mutex)
+      return "Not ready";
+   if (!j || jo_here (j) != JO_OBJECT)
+      return "Expecting JSON object";
+   jo_type_t t = jo_next (j);
+   while (t == JO_TAG && !e)
+   {
+      char tag[10] = "";
+      jo_strncpy (j, tag, sizeof (tag));
+      t = jo_next (j);
+      if (!strcmp (tag, "seq") && t == JO_NUMBER)
+         seq = jo_read_int (j);
+      else if (!strcmp (tag, "last"))
+         last = (t == JO_TRUE);
+      else if (!strcmp (tag, "data") && t == JO_STRING && !data)
+      {
+         len = jo_strlen (j);
+         data = mallocspi (len + 1);
+         if (!data)
+            e = "No memory";
+         else if ((len = jo_strncpy64 (j, data, len)) < 0)
+            e = "Bad base64";
+      }
+      t = jo_skip (j);
+   }
+   if (!e && seq < 0)
+      e = "Expecting seq";
+   xSemaphoreTake (push_mutex, portMAX_DELAY);
+   if (!e && pushweb)
+      e = "Upload in progress";
+   if (!e && seq && seq != pushseq)
+      e = "Out of sequence";
+   if (!e && !seq)
+   {                            // New image
+      if (pushseq >= 0)
+         push_abort ();
+      e = push_start (&push);
+   }
+   if (!e)
+   {
+      stream_data (&push, len, data);
+      pushseq = seq + 1;
+      pushat = uptime ();
+      if (last)
+      {
+         int r = push_end (&push);
+         pushseq = -1;
+         if (r < 0)
+            e = "Bad image";
+         else
+         {
+            jo_t j = jo_object_alloc ();
+            jo_int (j, "size", pushed->size);
+            jo_bool (j, "changed", r > 0);
+            revk_info ("image", &j);
+         }
+      }
+   } else if (pushseq >= 0)
+      push_abort ();
+   xSemaphoreGive (push_mutex);
+   free (data);
+   return e ? : "";
+}
+
+static esp_err_t
+web_image (httpd_req_t * req)
+{                               // PUT or POST /image, same as the image command but in one go
+   if (!imageupload)
+      return httpd_resp_send_err (req, HTTPD_403_FORBIDDEN, "Upload not enabled");
+   if (!push_mutex)
+      return httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "Not ready");
+   xSemaphoreTake (push_mutex, portMAX_DELAY);
+   uint8_t busy = (pushweb || pushseq >= 0);
+   if (!busy)
+      pushweb = 1;              // Same pushed file and temp file as push, so one at a time
+   xSemaphoreGive (push_mutex);
+   if (busy)
+      return httpd_resp_send_custom_err (req, "409 Conflict", "Push in progress");
+   esp_err_t done (esp_err_t r)
+   {
+      xSemaphoreTake (push_mutex, portMAX_DELAY);
+      pushweb = 0;
+      xSemaphoreGive (push_mutex);
+      return r;
+   }
+   stream_t s;
+   const char *e = push_start (&s);
+   if (e)
+      return done (httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, e));
+   const int max = 1024;
+   char *buf = malloc (max);
+   if (!buf)
+      e = "No memory";
+   size_t left = req->content_len;
+   int timeouts = 0;
+   while (!e && left)
+   {                            // Decode as it arrives
+      int l = httpd_req_recv (req, buf, left < max ? left : max);
+      if (l == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < 5)
+         continue;
+      if (l <= 0)
+         e = "Receive failed";
+      else
+      {
+         stream_data (&s, l, (uint8_t *) buf);
+         left -= l;
+      }
+   }
+   free (buf);
+   if (e)
+      s.error = e;              // So not saved
+   int r = push_end (&s);
+   if (r < 0)
+      return done (httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, s.error ? : "Bad image"));
+   httpd_resp_set_type (req, "text/plain");
+   return done (httpd_resp_sendstr (req, r ? "Changed\n" : "Same\n"));
+}
+
+// Fetch task, downloads happen here so a slow server does not hold up the display
+
+void
+fetch_task (void *arg)
+{
+   uint32_t hash = 0;
+   uint32_t reported = 0;
+   {
+      uint8_t mac[6];
+      esp_read_mac (mac, ESP_MAC_WIFI_STA);
+      fetchjitter = esp_rom_crc32_le (0, mac, sizeof (mac));
+   }
+   xEventGroupWaitBits (events, EV_STARTUP, pdFALSE, pdTRUE, portMAX_DELAY);
+   uint32_t next = 0;
+   while (1)
+   {
+      {                         // Sleep until next check is due, so we can stay in light sleep
+         uint32_t up = uptime ();
+         xEventGroupWaitBits (events, EV_FETCH, pdTRUE, pdFALSE, pdMS_TO_TICKS ((next > up ? next - up : 1) * 1000));
+         next = uptime () + 60; // Seasonal changes
+      }
+      time_t now = time (0);
+      if (now < 1000000000)
+         now = 0;
+      char season = *revk_season (now);
+      file_t *file = NULL;
+      if (*imageurl)
+      {
+         char *url = strdup (imageurl);
+         char *m = strrchr (url, '.');
+         if (m && !strncmp (m, ".mono", 5))
+            strcpy (m, ".png"); // Backwards compatible bodge
+         char *s = strrchr (url, '*');
+         void due (file_t * f)
+         {
+            if (f && f->cache < next)
+               next = f->cache;
+         }
+         if (season && s)
+         {
+            *s = season;
+            due (file = download (url));
+         }
+         if (!file || !file->size)
+         {
+            if (s)
+               memmove (s, s + 1, strlen (s));
+            due (file = download (url));
+         }
+         free (url);
+         if (file && !file->w)
+            file = NULL;
+      }
+      file_t *p = pushed;
+      if (p && p->w && (!file || p->changed >= file->changed))
+         file = p;              // Pushed image is newer
+      if (file != image || (file && file->hash != hash))
+      {                         // New image for display
+         image = file;
+         hash = (file ? file->hash : 0);
+         event_set (EV_REDRAW);
+      }
+      push_idle ();
+      cache_trim ();
+      if (cachebytes != reported)
+      {
+         reported = cachebytes;
+         int n = 0;
+         for (file_t * i = files; i; i = i->next)
+            n++;
+         jo_t j = jo_object_alloc ();
+         jo_int (j, "files", n);
+         jo_int (j, "bytes", cachebytes);
+         if (imagecache)
+            jo_int (j, "budget", imagecache);
+         if (cacheevicted)
+            jo_int (j, "evicted", cacheevicted);
+         revk_info ("cache", &j);
+      }
+   }
+}
+
+// Image plot
+
+static gfx_pos_t clipt = 0,     // Rows being drawn
+   clipb = 0x7FFF;
+
+void
+plot (file_t * i, gfx_pos_t ox, gfx_pos_t oy)
+{
+   if (!i->bits)
+      return;
+   if (i->plot != imageplot + 1)
+      prerender (i);            // Plot mode changed
+   if (!i->plot)
+      return;
+   int64_t start = esp_timer_get_time ();
+   gfx_colour ('K');
+   planes_blit (i->plotk, i->w, i->h, i->line, ox, oy, clipt, clipb);
+   gfx_colour ('W');
+   planes_blit (i->plotw, i->w, i->h, i->line, ox, oy, clipt, clipb);
+   if (i->plotr)
+   {
+      gfx_colour ('R');
+      planes_blit (i->red, i->w, i->h, i->line, ox, oy, clipt, clipb);
+   }
+   perf_since (PERF_PLOT, start);
+}
+
+// Overlay, what is drawn is recorded first, so we can tell if the frame has changed at all
+
+enum
+{
+   OV_IMAGE,
+   OV_TEXT,
+   OV_7SEG,
+   OV_FILL,
+   OV_QR,
+};
+
+typedef struct ov_s
+{
+   file_t *file;                // Image
+   char *text;                  // Text, or QR value (malloc'd)
+   uint32_t hash;               // Image hash
+   gfx_pos_t x,                 // Position
+     y;
+   gfx_pos_t w,                 // Fill size, QR size, or image size
+     h;
+   gfx_align_t a;               // Alignment
+   int8_t size;                 // Text size, or image plot mode
+   uint8_t value;               // Fill value
+   uint8_t op;                  // What to draw
+} ov_t;
+
+#define	OVMAX	32
+static ov_t ov[OVMAX],          // This frame
+  ovlast[OVMAX];                // Last frame drawn
+static uint8_t ovn = 0,
+   ovlastn = 0;
+static uint8_t ovvalid = 0;     // Last frame is what is on the display
+static gfx_pos_t ovx = 0,
+   ovy = 0;
+static gfx_align_t ova = 0;
+
+static ov_t *
+ov_add (uint8_t op)
+{
+   if (ovn >= OVMAX)
+      return NULL;
+   ov_t *o = &ov[ovn++];
+   memset (o, 0, sizeof (*o));
+   o->op = op;
+   o->x = ovx;
+   o->y = ovy;
+   o->a = ova;
+   return o;
+}
+
+void
+ov_pos (gfx_pos_t x, gfx_pos_t y, gfx_align_t a)
+{
+   ovx = x;
+   ovy = y;
+   ova = a;
+}
+
+gfx_pos_t
+ov_y (void)
+{
+   return ovy;
+}
+
+gfx_align_t
+ov_a (void)
+{
+   return ova;
+}
+
+void
+ov_image (file_t * i)
+{
+   ov_t *o = ov_add (OV_IMAGE);
+   if (!o)
+      return;
+   o->file = i;
+   o->text = strdup (i->url);   // URL, size, and hash, as file may be gone by the time this is last frame
+   o->hash = i->hash;
+   o->w = i->w;
+   o->h = i->h;
+   o->size = imageplot;
+}
+
+void
+ov_fill (gfx_pos_t w, gfx_pos_t h, uint8_t value)
+{
+   ov_t *o = ov_add (OV_FILL);
+   if (!o)
+      return;
+   o->w = w;
+   o->h = h;
+   o->value = value;
+}
+
+void
+ov_qr (const char *value, gfx_pos_t max)
+{
+   ov_t *o = ov_add (OV_QR);
+   if (!o)
+      return;
+   o->text = strdup (value);
+   o->w = o->h = max;
+}
+
+static void
+ov_vtext (uint8_t op, int8_t size, const char *fmt, va_list ap)
+{
+   ov_t *o = ov_add (op);
+   if (!o)
+      return;
+   o->size = size;
+   if (vasprintf (&o->text, fmt, ap) < 0)
+      o->text = NULL;
+}
+
+void
+ov_text (int8_t size, const char *fmt, ...)
+{
+   va_list ap;
+   va_start (ap, fmt);
+   ov_vtext (OV_TEXT, size, fmt, ap);
+   va_end (ap);
+}
+
+void
+ov_7seg (int8_t size, const char *fmt, ...)
+{
+   va_list ap;
+   va_start (ap, fmt);
+   ov_vtext (OV_7SEG, size, fmt, ap);
+   va_end (ap);
+}
+
+static void
+ov_clear (ov_t * o, uint8_t n)
+{
+   while (n--)
+   {
+      free (o->text);
+      o->text = NULL;
+      o++;
+   }
+}
+
+static int
+ov_same (const ov_t * a, const ov_t * b)
+{
+   if (a->op != b->op || a->file != b->file || a->hash != b->hash || a->x != b->x || a->y != b->y || a->w != b->w
+       || a->h != b->h || a->a != b->a || a->size != b->size || a->value != b->value)
+      return 0;
+   if (!a->text || !b->text)
+      return a->text == b->text;
+   return !strcmp (a->text, b->text);
+}
+
+void
+ov_start (void)
+{                               // Start recording a frame
+   ov_clear (ov, ovn);
+   ovn = 0;
+   ov_pos (0, 0, 0);
+}
+
+static int
+ov_rows (const ov_t * o, gfx_pos_t * t, gfx_pos_t * b)
+{                               // Rows a bottom aligned text widget uses, as laid out in the main loop
+   if ((o->op != OV_TEXT && o->op != OV_7SEG) || (o->a & (GFX_T | GFX_B)) != GFX_B)
+      return 0;
+   *b = o->y;
+   *t = o->y + 1 - (o->size < 0 ? -o->size : o->size) * (o->op == OV_TEXT && o->size > 0 ? 8 : 10);
+   return 1;
+}
+
+static int
+ov_region (gfx_pos_t * t, gfx_pos_t * b)
+{                               // If only text widgets changed, the rows they need redrawing
+   if (!ovvalid || ovn != ovlastn)
+      return 0;
+   gfx_pos_t rt = 0x7FFF,
+      rb = -1;
+   for (int n = 0; n < ovn; n++)
+   {
+      ov_t *o = &ov[n],
+         *l = &ovlast[n];
+      if (ov_same (o, l))
+         continue;
+      gfx_pos_t ot,
+        ob;
+      if (!o->text || !l->text || o->op != l->op || o->x != l->x || o->y != l->y || o->a != l->a || o->size != l->size
+          || !ov_rows (o, &ot, &ob))
+         return 0;
+      if (ot < rt)
+         rt = ot;
+      if (ob > rb)
+         rb = ob;
+   }
+   if (rb < rt)
+      return 0;
+   int more = 1;
+   while (more)
+   {                            // Include all of anything else in those rows
+      more = 0;
+      for (int n = 0; n < ovn; n++)
+      {
+         gfx_pos_t ot,
+           ob;
+         if (ov_rows (&ov[n], &ot, &ob) && ot <= rb && ob >= rt && (ot < rt || ob > rb))
+         {
+            if (ot < rt)
+               rt = ot;
+            if (ob > rb)
+               rb = ob;
+            more = 1;
+         }
+      }
+   }
+   if (rt < 0)
+      rt = 0;
+   if (rb >= gfx_height ())
+      rb = gfx_height () - 1;
+   *t = rt;
+   *b = rb;
+   return 1;
+}
+
+int
+ov_changed (void)
+{                               // Is recorded frame different to last one drawn
+   if (!ovvalid || ovn != ovlastn)
+      return 1;
+   for (int n = 0; n < ovn; n++)
+      if (!ov_same (&ov[n], &ovlast[n]))
+         return 1;
+   return 0;
+}
+
+void
+ov_draw_rows (gfx_pos_t t, gfx_pos_t b)
+{                               // Draw the recorded frame (gfx locked) over rows t to b, and keep as last drawn
+   int64_t start = esp_timer_get_time ();
+   clipt = t;
+   clipb = b;
+   if (t <= 0 && b >= gfx_height () - 1)
+      gfx_clear (0);
+   else
+   {
+      gfx_pos (0, t, GFX_L | GFX_T);
+      gfx_fill (gfx_width (), b - t + 1, 0);
+   }
+   gfx_colour ('K');
+   gfx_background ('B');
+   for (int n = 0; n < ovn; n++)
+   {
+      ov_t *o = &ov[n];
+      gfx_pos_t ot,
+        ob;
+      if (ov_rows (o, &ot, &ob) && (ob < t || ot > b))
+         continue;              // Not in these rows
+      if (o->op == OV_IMAGE)
+      {
+         plot (o->file, o->x, o->y);
+         gfx_colour ('K');
+         gfx_background ('B');
+         continue;
+      }
+      gfx_pos (o->x, o->y, o->a);
+      switch (o->op)
+      {
+      case OV_TEXT:
+         if (o->text)
+            gfx_text (o->size, "%s", o->text);
+         break;
+      case OV_7SEG:
+         if (o->text)
+            gfx_7seg (o->size, "%s", o->text);
+         break;
+      case OV_FILL:
+         gfx_fill (o->w, o->h, o->value);
+         break;
+      case OV_QR:
+         if (o->text)
+            gfx_qr (o->text, o->w);
+         break;
+      }
+   }
+   clipt = 0;
+   clipb = 0x7FFF;
+   perf_since (PERF_OVERLAY, start);
+   ov_clear (ovlast, ovlastn);
+   memcpy (ovlast, ov, sizeof (*ov) * ovn);
+   ovlastn = ovn;
+   ovn = 0;                     // Texts now owned by ovlast
+   ovvalid = 1;
+}
+
+void
+ov_draw (void)
+{                               // Draw the whole recorded frame (gfx locked)
+   ov_draw_rows (0, gfx_height () - 1);
+}
+
+// Ghosting, partial updates are counted per band of rows, by the area the changed parts of the frame cover
+
+#define	GHOSTBANDS	8
+
+static uint64_t ghost[GHOSTBANDS] = { 0 };      // Changed area per band since full refresh (pixels)
+static uint32_t ghostn = 0;     // Partial updates since full refresh
+
+static void
+ghost_clear (void)
+{                               // Full refresh done
+   memset (ghost, 0, sizeof (ghost));
+   ghostn = 0;
+}
+
+static void
+ghost_rows (gfx_pos_t t, gfx_pos_t b, uint32_t w)
+{                               // Changed w pixels wide over rows t to b
+   gfx_pos_t rows = (gfx_height () + GHOSTBANDS - 1) / GHOSTBANDS;
+   if (t < 0)
+      t = 0;
+   if (b >= gfx_height ())
+      b = gfx_height () - 1;
+   if (w > gfx_width ())
+      w = gfx_width ();
+   for (gfx_pos_t y = t; y <= b; y = (y / rows + 1) * rows)
+   {
+      gfx_pos_t e = (y / rows + 1) * rows - 1;
+      if (e > b)
+         e = b;
+      ghost[y / rows] += (uint64_t) w * (e - y + 1);
+   }
+}
+
+static void
+ghost_area (const ov_t * o, gfx_pos_t * t, gfx_pos_t * b, uint32_t * w)
+{                               // Area an entry covers, as best we can tell
+   *w = gfx_width ();           // Text width is not known
+   if (ov_rows (o, t, b))
       return;
-   i->changed = time (0);
-   const char *e1 = lwpng_get_info (i->size, i->data, &i->w, &i->h);
-   if (!e1)
+   if (o->op == OV_IMAGE || o->op == OV_FILL || o->op == OV_QR)
    {
-      i->json = 0;              // PNG
-      i->new = 1;
-      ESP_LOGE (TAG, "Image %s len %lu width %lu height %lu", i->url, i->size, i->w, i->h);
-   } else
-   {                            // Not a png
-      jo_t j = jo_parse_mem (i->data, i->size);
-      jo_skip (j);
-      const char *e2 = jo_error (j, NULL);
-      jo_free (&j);
-      if (!e2)
-      {                         // Valid JSON
-         i->json = 1;
-         i->new = 1;
-         i->w = i->h = 0;
-         ESP_LOGE (TAG, "JSON %s len %lu", i->url, i->size);
+      *w = o->w;
+      if (o->op != OV_IMAGE && (o->a & (GFX_T | GFX_B)) == GFX_B)
+      {
+         *t = o->y - o->h + 1;
+         *b = o->y;
       } else
-      {                         // Not sensible
-         free (i->data);
-         i->data = NULL;
-         i->size = 0;
-         i->w = i->h = 0;
-         i->changed = 0;
-         ESP_LOGE (TAG, "Unknown %s error %s %s", i->url, e1 ? : "", e2 ? : "");
+      {
+         *t = o->y;
+         *b = o->y + o->h - 1;
       }
+      return;
    }
+   *t = 0;
+   *b = gfx_height () - 1;
 }
 
-file_t *
-download (char *url)
-{
-   file_t *i = find_file (url);
-   if (!i)
-      return i;
-   url = strdup (i->url);       // Use as is
-   ESP_LOGD (TAG, "Get %s", url);
-   int32_t len = 0;
-   uint8_t *buf = NULL;
-   esp_http_client_config_t config = {
-      .url = url,
-      .crt_bundle_attach = esp_crt_bundle_attach,
-      .timeout_ms = 20000,
-   };
-   int response = -1;
-   if (i->cache > uptime ())
-      response = (i->data ? 304 : 404); // Cached
-   else if (!revk_link_down () && (!strncasecmp (url, "http://", 7) || !strncasecmp (url, "https://", 8)))
+static void
+ghost_add (void)
+{                               // Partial update of recorded frame over last drawn
+   ghostn++;
+   if (!ovvalid || ovn != ovlastn)
    {
-      i->cache = uptime () + recheck;
-      esp_http_client_handle_t client = esp_http_client_init (&config);
-      if (client)
-      {
-         if (i->changed)
-         {
-            char when[50];
-            struct tm t;
-            gmtime_r (&i->changed, &t);
-            strftime (when, sizeof (when), "%a, %d %b %Y %T GMT", &t);
-            esp_http_client_set_header (client, "If-Modified-Since", when);
-         }
-         if (!esp_http_client_open (client, 0))
-         {
-            len = esp_http_client_fetch_headers (client);
-            ESP_LOGD (TAG, "%s Len %ld", url, len);
-            if (!len)
-            {                   // Dynamic, FFS
-               size_t l;
-               FILE *o = open_memstream ((char **) &buf, &l);
-               if (o)
-               {
-                  char temp[64];
-                  while ((len = esp_http_client_read (client, temp, sizeof (temp))) > 0)
-                     fwrite (temp, len, 1, o);
-                  fclose (o);
-                  len = l;
-               }
-               if (!buf)
-                  len = 0;
-            } else
-            {
-               buf = mallocspi (len);
-               if (buf)
-                  len = esp_http_client_read_response (client, (char *) buf, len);
-            }
-            response = esp_http_client_get_status_code (client);
-            if (response != 200 && response != 304)
-               ESP_LOGE (TAG, "Bad response %s (%d)", url, response);
-            esp_http_client_close (client);
-         }
-         esp_http_client_cleanup (client);
+      ghost_rows (0, gfx_height () - 1, gfx_width ());
+      return;
+   }
+   for (int n = 0; n < ovn; n++)
+      if (!ov_same (&ov[n], &ovlast[n]))
+      {                         // New, and old if it covered somewhere else, e.g. a clock is the same area each time
+         gfx_pos_t t,
+           b,
+           ot,
+           ob;
+         uint32_t w,
+           ow;
+         ghost_area (&ov[n], &t, &b, &w);
+         ghost_area (&ovlast[n], &ot, &ob, &ow);
+         ghost_rows (t, b, w);
+         if (ot != t || ob != b || ow != w || (w < gfx_width () && ovlast[n].x != ov[n].x))
+            ghost_rows (ot, ob, ow);
       }
-      ESP_LOGD (TAG, "Got %s %d", url, response);
+}
+
+static int
+ghost_worst (void)
+{                               // Worst band, as percentage of budget
+   if (!ghostbudget)
+      return 0;
+   gfx_pos_t rows = (gfx_height () + GHOSTBANDS - 1) / GHOSTBANDS;
+   uint64_t area = (uint64_t) rows * gfx_width () * ghostbudget,
+      worst = 0;
+   for (int b = 0; b < GHOSTBANDS; b++)
+      if (ghost[b] > worst)
+         worst = ghost[b];
+   return worst * 100 / area;
+}
+
+// Last frame drawn is kept on SD, so it can be put back on the display straight away at power on
+
+#define	FRAMEMAGIC	0x46445045      // "EPDF"
+#define	FRAMESAVE	3600    // Save at least this often when frame changes (s)
+#define	FRAMEFILE	"frame" // Name for card_file
+
+typedef struct __attribute__((packed)) ov_rec_s
+{                               // Frame file record, followed by text (image URL for OV_IMAGE)
+   uint8_t op;
+   gfx_align_t a;
+   int8_t size;
+   uint8_t value;
+   gfx_pos_t x,
+     y,
+     w,
+     h;
+   uint32_t hash;
+   uint16_t len;
+} ov_rec_t;
+
+void
+frame_save (void)
+{                               // Save last frame drawn to SD
+   if (!card)
+      return;
+   FILE *f = card_create (FRAMEFILE);
+   if (!f)
+      return;
+   uint32_t head[2] = { FRAMEMAGIC, ovlastn };
+   int ok = (fwrite (head, sizeof (head), 1, f) == 1);
+   for (int n = 0; ok && n < ovlastn; n++)
+   {
+      ov_t *o = &ovlast[n];
+      const char *t = o->text ? : "";      // Image URL for OV_IMAGE
+      ov_rec_t r = {
+         .op = o->op,
+         .a = o->a,
+         .size = o->size,
+         .value = o->value,
+         .x = o->x,
+         .y = o->y,
+         .w = o->w,
+         .h = o->h,
+         .hash = o->hash,
+         .len = strlen (t),
+      };
+      ok = (fwrite (&r, sizeof (r), 1, f) == 1 && fwrite (t, r.len, 1, f) == (r.len ? 1 : 0));
    }
-   if (response != 304)
+   if (fclose (f))
+      ok = 0;
+   if (card_commit (FRAMEFILE, "ov", ok))
+      ESP_LOGE (TAG, "Frame save failed");
+}
+
+int
+frame_restore (void)
+{                               // Record frame saved on SD, loading its image from SD, returns 1 if there is one
+   if (!card)
+      return 0;
+   FILE *f = card_open (FRAMEFILE, "ov");
+   if (!f)
+      return 0;
+   uint32_t head[2] = { 0 };
+   int ok = (fread (head, sizeof (head), 1, f) == 1 && head[0] == FRAMEMAGIC && head[1] <= OVMAX);
+   ov_start ();
+   for (int n = 0; ok && n < head[1]; n++)
    {
-      if (response != 200)
-      {                         // Failed
-         jo_t j = jo_object_alloc ();
-         jo_string (j, "url", url);
-         if (response && response != -1)
-            jo_int (j, "response", response);
-         if (len == -ESP_ERR_HTTP_EAGAIN)
-            jo_string (j, "error", "timeout");
-         else if (len)
-            jo_int (j, "len", len);
-         revk_error ("image", &j);
-      }
-      if (buf)
+      ov_rec_t r;
+      char *t = NULL;
+      if (fread (&r, sizeof (r), 1, f) != 1 || !(t = malloc (r.len + 1)) || (r.len && fread (t, r.len, 1, f) != 1))
       {
-         if (i->data && i->size == len && !memcmp (buf, i->data, len))
-         {
-            free (buf);
-            response = 0;       // No change
-         } else
-         {                      // Change
-            free (i->data);
-            i->data = buf;
-            i->size = len;
-            check_file (i);
-         }
-         buf = NULL;
+         free (t);
+         ok = 0;
+         break;
       }
-   }
-   if (card)
-   {                            // SD
-      char *s = strrchr (url, '/');
-      if (!s)
-         s = url;
-      if (s)
+      t[r.len] = 0;
+      ov_pos (r.x, r.y, r.a);
+      ov_t *o = ov_add (r.op);
+      o->size = r.size;
+      o->value = r.value;
+      o->w = r.w;
+      o->h = r.h;
+      o->hash = r.hash;
+      o->text = t;
+      if (r.op != OV_IMAGE)
+         continue;
+      file_t *i = find_file (t);
+      if (i && !i->bits)
       {
-         char *fn = NULL;
-         if (*s == '/')
-            s++;
-         asprintf (&fn, "%s/%s", sd_mount, s);
-         char *q = fn + sizeof (sd_mount);
-         while (*q && isalnum ((int) (uint8_t) * q))
-            q++;
-         if (*q == '.')
-         {
-            q++;
-            while (*q && isalnum ((int) (uint8_t) * q))
-               q++;
-         }
-         *q = 0;
-         if (i->data && response == 200)
-         {                      // Save to card
-            FILE *f = fopen (fn, "w");
-            if (f)
-            {
-               jo_t j = jo_object_alloc ();
-               if (fwrite (i->data, i->size, 1, f) != 1)
-                  jo_string (j, "error", "write failed");
-               fclose (f);
-               jo_string (j, "write", fn);
-               revk_info ("SD", &j);
-               ESP_LOGE (TAG, "Write %s %lu", fn, i->size);
-            } else
-               ESP_LOGE (TAG, "Write fail %s", fn);
-         } else if (!i->card && (!i->data || (response && response != 304 && response != -1)))
-         {                      // Load from card
-            i->card = 1;        // card tried, no need to try again
-            FILE *f = fopen (fn, "r");
-            if (f)
-            {
-               struct stat s;
-               fstat (fileno (f), &s);
-               free (buf);
-               buf = mallocspi (s.st_size);
-               if (buf)
-               {
-                  if (fread (buf, s.st_size, 1, f) == 1)
-                  {
-                     if (i->data && i->size == s.st_size && !memcmp (buf, i->data, i->size))
-                     {
-                        free (buf);
-                        response = 0;   // No change
-                     } else
-                     {
-                        ESP_LOGE (TAG, "Read %s", fn);
-                        jo_t j = jo_object_alloc ();
-                        jo_string (j, "read", fn);
-                        revk_info ("SD", &j);
-                        response = 200; // Treat as received
-                        free (i->data);
-                        i->data = buf;
-                        i->size = s.st_size;
-                        check_file (i);
-                     }
-                     buf = NULL;
-                  }
-               }
-               fclose (f);
-            } else
-               ESP_LOGE (TAG, "Read fail %s", fn);
-         }
-         free (fn);
+         i->card = 1;
+         card_load (i);
+      }
+      if (!i || !i->bits)
+         ok = 0;
+      else
+      {                         // Card may have a newer image than was shown, which is fine
+         o->file = i;
+         o->hash = i->hash;
+         o->w = i->w;
+         o->h = i->h;
       }
    }
-   free (buf);
-   free (url);
-   return i;
+   fclose (f);
+   if (!ok)
+      ov_start ();
+   return ok;
 }
 
-// Image plot
+// Overlay widgets, content is only worked out again when something it depends on changes
 
-typedef struct plot_s
-{
-   gfx_pos_t ox,
-     oy;
-} plot_t;
+enum
+{                               // Widget inputs
+   DEP_MINUTE = (1 << 0),
+   DEP_DAY = (1 << 1),
+   DEP_SNMP = (1 << 2),
+   DEP_DEFCON = (1 << 3),
+   DEP_WIFI = (1 << 4),
+   DEP_SETTING = (1 << 5),
+};
 
-static void *
-my_alloc (void *opaque, uInt items, uInt size)
+enum
 {
-   return mallocspi (items * size);
-}
+   W_TIME,
+   W_HOST,
+   W_DESC,
+   W_DAY,
+   W_DEFCON,
+   W_SET,
+   W_RISE,
+   W_SSID,
+   W_PASS,
+   W_QR,
+   W_MAX
+};
 
-static void
-my_free (void *opaque, void *address)
+typedef struct widget_s
 {
-   free (address);
+   uint8_t deps;                // Inputs
+   char *text;                  // Content
+} widget_t;
+
+static widget_t widgets[W_MAX] = {
+   [W_TIME] = {DEP_MINUTE | DEP_SETTING},
+   [W_HOST] = {DEP_SNMP | DEP_SETTING},
+   [W_DESC] = {DEP_SNMP | DEP_SETTING},
+   [W_DAY] = {DEP_DAY | DEP_SETTING},
+   [W_DEFCON] = {DEP_DEFCON | DEP_SETTING},
+   [W_SET] = {DEP_DAY | DEP_SETTING},
+   [W_RISE] = {DEP_DAY | DEP_SETTING},
+   [W_SSID] = {DEP_WIFI | DEP_SETTING},
+   [W_PASS] = {DEP_WIFI | DEP_SETTING},
+   [W_QR] = {DEP_WIFI | DEP_SETTING},
+};
+
+static uint8_t widgetdeps = 0;  // Inputs changed this frame
+
+int
+widget_stale (int w)
+{                               // Widget content needs working out again
+   return !widgets[w].text || (widgets[w].deps & widgetdeps);
 }
 
-static const char *
-pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+void
+widget_set (int w, const char *fmt, ...)
 {
-   plot_t *p = opaque;
-   if (a & 0x8000)
-      gfx_pixel (p->ox + x, p->oy + y, (g & 0x8000) ? 255 : 0);
-   return NULL;
+   free (widgets[w].text);
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&widgets[w].text, fmt, ap) < 0)
+      widgets[w].text = NULL;
+   va_end (ap);
 }
 
-void
-plot (file_t * i, gfx_pos_t ox, gfx_pos_t oy)
+const char *
+widget_text (int w)
 {
-   plot_t settings = { ox, oy };
-   lwpng_t *p = lwpng_init (&settings, NULL, &pixel, &my_alloc, &my_free, NULL);
-   lwpng_data (p, i->size, i->data);
-   const char *e = lwpng_end (&p);
-   if (e)
-      ESP_LOGE (TAG, "PNG fail %s", e);
+   return widgets[w].text ? : "";
 }
 
 //--------------------------------------------------------------------------------
@@ -496,6 +2789,7 @@ plot (file_t * i, gfx_pos_t ox, gfx_pos_t oy)
 void
 app_main ()
 {
+   events = xEventGroupCreate ();
    revk_boot (&app_callback);
    revk_start ();
 
@@ -521,6 +2815,8 @@ app_main ()
       gpio_reset_pin (gfxena.num);
       gpio_set_direction (gfxena.num, GPIO_MODE_OUTPUT);
       gpio_set_level (gfxena.num, gfxena.invert);       // Enable
+      panelon = esp_timer_get_time ();
+      usleep (PANELSETTLE * 1000);
    }
    {
     const char *e = gfx_init (cs: gfxcs.num, sck: gfxsck.num, mosi: gfxmosi.num, dc: gfxdc.num, rst: gfxrst.num, busy: gfxbusy.num, flip: gfxflip, direct: 1, invert:gfxinvert);
@@ -552,7 +2848,7 @@ app_main ()
       host.slot = SDMMC_HOST_SLOT_1;
       esp_vfs_fat_sdmmc_mount_config_t mount_config = {
          .format_if_mount_failed = 1,
-         .max_files = 2,
+         .max_files = 5,        // Download, push, upload, frame, and a spare
          .allocation_unit_size = 16 * 1024,
          .disk_status_check_enable = 1,
       };
@@ -569,37 +2865,154 @@ app_main ()
          ESP_LOGE (TAG, "SD Mounted %llu/%llu", sdfree, sdsize);
       }
    }
-   gfx_lock ();
-   gfx_clear (0);
-   for (int y = 0; y < gfx_height (); y++)
-      for (int x = (y & 1); x < gfx_width (); x += 2)
-         gfx_pixel (x, y, 255);
-   gfx_refresh ();
-   gfx_unlock ();
-   gfx_lock ();
-   gfx_clear (0);
-   for (int y = 0; y < gfx_height (); y++)
-      for (int x = 1 - (y & 1); x < gfx_width (); x += 2)
-         gfx_pixel (x, y, 255);
-   gfx_refresh ();
-   gfx_unlock ();
+   image_mutex = xSemaphoreCreateMutex ();
+   push_mutex = xSemaphoreCreateMutex ();
+   perf_mutex = xSemaphoreCreateMutex ();
+   if (gfxclean)
+   {
+      gfx_lock ();
+      gfx_clear (0);
+      for (int y = 0; y < gfx_height (); y++)
+         for (int x = (y & 1); x < gfx_width (); x += 2)
+            gfx_pixel (x, y, 255);
+      gfx_refresh ();
+      gfx_unlock ();
+      gfx_lock ();
+      gfx_clear (0);
+      for (int y = 0; y < gfx_height (); y++)
+         for (int x = 1 - (y & 1); x < gfx_width (); x += 2)
+            gfx_pixel (x, y, 255);
+      gfx_refresh ();
+      gfx_unlock ();
+   }
+   if (card && push_file ())
+   {                            // Last pushed image
+      if (card_load (pushed) < 0)
+      {
+         free (pushed->url);
+         free (pushed);
+         pushed = NULL;
+      }
+   }
+   int64_t restored = 0;        // When last frame was back on display (us)
+   if (frame_restore ())
+   {                            // Before fetch task starts, as that owns files
+      gfx_lock ();
+      gfx_refresh ();
+      ov_draw ();
+      gfx_unlock ();
+      restored = esp_timer_get_time ();
+      ESP_LOGE (TAG, "Frame restored %lldms", restored / 1000LL);
+   }
+   revk_task ("fetch", fetch_task, NULL, 8);
+   snmp_init (SNMPPOLL);
+   if (webserver)
+   {
+      httpd_uri_t uri = {
+         .uri = "/image",
+         .handler = web_image,
+      };
+      uri.method = HTTP_PUT;
+      REVK_ERR_CHECK (httpd_register_uri_handler (webserver, &uri));
+      uri.method = HTTP_POST;
+      REVK_ERR_CHECK (httpd_register_uri_handler (webserver, &uri));
+   }
+   int64_t content = 0;         // When first live frame was on display (us)
+   uint32_t framedue = 0;
+   uint32_t framehash = 0;
+   uint32_t perfdue = 0;
    uint32_t fresh = 0;
    uint32_t min = 0;
-   uint32_t check = 0;
-   char snmphost[65] = "";
-   char snmpdesc[65] = "";
+   char snmphost[SNMP_STRMAX] = "";
+   char snmpdesc[SNMP_STRMAX] = "";
+   char *snmphosting = NULL;
+   int snmpup = -1,
+      snmpname = -1,
+      snmpdescr = -1;
+   uint32_t snmpwhen = 0;
+   void snmp_target (const char *host)
+   {                            // Set (or clear) the host we poll for uptime
+      if (host && snmphosting && !strcmp (host, snmphosting))
+         return;
+      if (snmphosting)
+      {
+         snmp_forget (snmphosting);
+         free (snmphosting);
+         snmphosting = NULL;
+         snmpup = snmpname = snmpdescr = -1;
+         *snmphost = *snmpdesc = 0;
+      }
+      if (!host)
+         return;
+      snmphosting = strdup (host);
+      snmpup = snmp_watch (host, "1.3.6.1.2.1.1.3.0");
+      snmpname = snmp_watch (host, "1.3.6.1.2.1.1.5.0");
+      snmpdescr = snmp_watch (host, "1.3.6.1.2.1.1.1.0");
+   }
+   uint32_t depmin = -1;
+   int depday = -1;
+   int depdefcon = -2;
+   uint8_t depwifi = 0;
+   EventBits_t pending = 0;     // Events not yet acted on
+   int64_t updated = 0;         // Last panel update (us)
+   int64_t redrawat = 0;        // When pending redraw is due (us)
+   TickType_t wait (uint32_t up)
+   {                            // Until next minute, or other thing due
+      struct timeval tv;
+      gettimeofday (&tv, NULL);
+      uint32_t ms = 1000;       // Until we have a clock
+      if (tv.tv_sec >= 1000000000)
+         ms = 60000 - (tv.tv_sec % 60) * 1000 - tv.tv_usec / 1000 + 10;
+      uint32_t due (uint32_t when)
+      {                         // ms until just after when
+         return (when >= up ? when - up + 1 : 0) * 1000;
+      }
+      if (override && due (override) < ms)
+         ms = due (override);
+      if (perfreport && perfdue && due (perfdue) < ms)
+         ms = due (perfdue);
+      if (redrawat)
+      {
+         int64_t d = (redrawat - esp_timer_get_time ()) / 1000 + 1;
+         if (d < ms)
+            ms = (d > 0 ? d : 0);
+      }
+      return pdMS_TO_TICKS (ms);
+   }
+   int gated (void)
+   {                            // Panel only powered to update, not worth it if updating every minute
+      return lowpower && gfxena.set && image && !showtime;
+   }
+   int64_t woke = 0;
    while (1)
    {
-      usleep (100000);
+      if (woke)
+         mainus += esp_timer_get_time () - woke;
+      if (!gated ())
+         panel_power (1);
+      pending |= (xEventGroupWaitBits (events, EV_WAKE, pdTRUE, pdFALSE, wait (uptime ())) & EV_WAKE);
+      woke = esp_timer_get_time ();
       time_t now = time (0);
       if (now < 1000000000)
          now = 0;
       uint32_t up = uptime ();
-      if (b.wificonnect)
+      if (perfreport && up >= perfdue)
+      {
+         if (perfdue)
+            perf_report ();
+         perfdue = up + perfreport;
+      }
+      if (pending & (EV_WIFICONNECT | EV_SETTING))
+         power_wifi ();
+      if (pending & EV_WIFICONNECT)
       {
+         panel_power (1);
          gfx_refresh ();
-         b.startup = 1;
-         b.wificonnect = 0;
+         ghost_clear ();
+         ovvalid = 0;           // Redraw after startup message
+         depwifi = 1;
+         event_set (EV_STARTUP);
+         pending &= ~EV_WIFICONNECT;
          if (startup)
          {
             char msg[1000];
@@ -689,6 +3102,11 @@ app_main ()
                   }
                }
                gfx_unlock ();
+               if (gated ())
+               {
+                  panel_idle ();
+                  panel_power (0);
+               }
             }
             free (qr1);
             free (qr2);
@@ -701,74 +3119,69 @@ app_main ()
          else
             continue;
       }
-      if (!b.startup || (now / 60 == min && !b.redraw))
+      if ((pending & EV_REDRAW) && now / 60 == min)
+      {                         // Coalesce bursts of changes, and limit update rate
+         int64_t us = esp_timer_get_time ();
+         if (!redrawat)
+         {
+            redrawat = us + redrawhold * 1000LL;
+            if (updated && redrawat < updated + redrawmin * 1000000LL)
+               redrawat = updated + redrawmin * 1000000LL;
+         }
+         if (us < redrawat)
+            continue;
+      }
+      if (!(event_get () & EV_STARTUP) || (now / 60 == min && !(pending & EV_REDRAW)))
          continue;              // Check / update every minute
+      redrawat = 0;
       min = now / 60;
       struct tm t;
       localtime_r (&now, &t);
-      if (*lights && !b.lightoverride)
+      if (*lights && !(event_get () & EV_LIGHTOVERRIDE))
       {
          int hhmm = t.tm_hour * 100 + t.tm_min;
          showlights (lighton == lightoff || (lighton < lightoff && lighton <= hhmm && lightoff > hhmm)
                      || (lightoff < lighton && (lighton <= hhmm || lightoff > hhmm)) ? lights : "");
       }
-      {                         // Seasonal changes
-         season = *revk_season (now);
-         if (!recheck || now / recheck != check)
-         {                      // Periodic image check
-            if (recheck)
-               check = now / recheck;
-         }
+      pending &= ~EV_REDRAW;
+      // What has changed
+      widgetdeps = 0;
+      if (now / 60 != depmin)
+      {
+         depmin = now / 60;
+         widgetdeps |= DEP_MINUTE;
       }
-      file_t *file = NULL;
-      if (*imageurl)
+      if (t.tm_yday != depday)
       {
-         char *url = strdup (imageurl);
-         char *m = strrchr (url, '.');
-         if (m && !strncmp (m, ".mono", 5))
-            strcpy (m, ".png"); // Backwards compatible bodge
-         char *s = strrchr (url, '*');
-         if (season)
-         {
-            *s = season;
-            file = download (url);
-         }
-         if (!file || !file->size)
-         {
-            strcpy (s, s + 1);
-            file = download (url);
-         }
-         free (url);
-         if (file && !file->w)
-            file = NULL;
+         depday = t.tm_yday;
+         widgetdeps |= DEP_DAY;
       }
-      b.redraw = 0;
-      // Static image
-      gfx_lock ();
-      if (refresh && now / refresh != fresh)
-      {                         // Periodic refresh, e.g.once a day
-         fresh = now / refresh;
-         gfx_refresh ();
-      } else if (file && file->new)
+      if (defcon != depdefcon)
       {
-         file->new = 0;
-         if (gfxnight && t.tm_hour >= 2 && t.tm_hour < 4)
-            gfx_refresh ();     // Full update
+         depdefcon = defcon;
+         widgetdeps |= DEP_DEFCON;
       }
-      gfx_clear (0);
-      if (file)
+      if (depwifi)
       {
-         gfx_colour (imageplot == REVK_SETTINGS_IMAGEPLOT_NORMAL || imageplot == REVK_SETTINGS_IMAGEPLOT_MASK ? 'K' : 'W');
-         gfx_background (imageplot == REVK_SETTINGS_IMAGEPLOT_NORMAL
-                         || imageplot == REVK_SETTINGS_IMAGEPLOT_MASKINVERT ? 'W' : 'K');
-         plot (file, 0, 0);
-      } else
+         depwifi = 0;
+         widgetdeps |= DEP_WIFI;
+      }
+      if (pending & EV_SETTING)
+      {
+         pending &= ~EV_SETTING;
+         widgetdeps |= DEP_SETTING;
+      }
+      // Static image
+      xSemaphoreTake (image_mutex, portMAX_DELAY);
+      file_t *file = image;
+      ov_start ();
+      if (file)
+         ov_image (file);
+      else
       {                         // Error
-         gfx_pos (0, 0, GFX_L | GFX_T);
-         gfx_text (-2, "%s", *imageurl ? imageurl : "No URL set");
+         ov_pos (0, 0, GFX_L | GFX_T);
+         ov_text (-2, "%s", *imageurl ? imageurl : "No URL set");
       }
-      gfx_colour ('K');
-      gfx_background ('B');
       // Info at bottom
       gfx_pos_t y = gfx_height () - 1;
       gfx_pos_t lasty = 0;
@@ -777,16 +3190,16 @@ app_main ()
       {
          if (lasts & LINE)
          {
-            gfx_pos (0, y, 0);
-            gfx_fill (gfx_width (), 1, 255);
+            ov_pos (0, y, 0);
+            ov_fill (gfx_width (), 1, 255);
             y -= ((lasts & MASK) ? : MINSIZE) / 2;
             y -= ((s & MASK) ? : MINSIZE) / 2;
          }
          if (((lasts & RIGHT) && (s & LEFT)) || ((lasts & LEFT) && (s & RIGHT)))
             y = lasty;          // Assuming left/right can coexist (may be the case for DEFCON)
          lasts = s;
-         gfx_pos ((s & LEFT) ? 0 : (s & RIGHT) ? gfx_width () - 1 : gfx_width () / 2, lasty = y,
-                  (s & LEFT ? GFX_L : 0) | (s & RIGHT ? GFX_R : 0) | (s & (LEFT | RIGHT) ? 0 : GFX_C) | GFX_B);
+         ov_pos ((s & LEFT) ? 0 : (s & RIGHT) ? gfx_width () - 1 : gfx_width () / 2, lasty = y,
+                 (s & LEFT ? GFX_L : 0) | (s & RIGHT ? GFX_R : 0) | (s & (LEFT | RIGHT) ? 0 : GFX_C) | GFX_B);
          s &= MASK;
          if (!s)
             s = MINSIZE;
@@ -795,274 +3208,173 @@ app_main ()
       if (showtime || !file)
       {
          int s = start (showtime);
-         if (*refdate)
+         if (widget_stale (W_TIME))
          {
-            uint64_t secs = 0;
-
-            int year = t.tm_year + 1900;
-            struct tm t = { 0 };
-            int y = 0,
-               m = 0,
-               d = 0,
-               H = 0,
-               M = 0,
-               S = 0;
-            if (sscanf (refdate, "%d-%d-%d %d:%d:%d", &y, &m, &d, &H, &M, &S) >= 3)
+            uint32_t snmp = esp_rom_crc32_le (esp_rom_crc32_le (0, (uint8_t *) snmphost, sizeof (snmphost)),
+                                              (uint8_t *) snmpdesc, sizeof (snmpdesc));
+            if (!*refdate)
+               snmp_target (NULL);
+            if (*refdate)
             {
-               t.tm_year = (y ? : year) - 1900;
-               t.tm_mon = m - 1;
-               t.tm_mday = d;
-               t.tm_hour = H;
-               t.tm_min = M;
-               t.tm_sec = S;
-               t.tm_isdst = -1;
-               int s = mktime (&t) - now;
-               if (s < 0 && !y)
-               {                // To next date
-                  t.tm_year++;
-                  t.tm_isdst = -1;
-                  s = mktime (&t) - now;
-               }
-               if (s < 0)
-                  s = -s;
-               secs = s;
-            } else
-            {                   // Try uptime as hostname
-               for (int try = 0; try < 3; try++)
+               uint64_t secs = 0;
+
+               int year = t.tm_year + 1900;
+               struct tm t = { 0 };
+               int y = 0,
+                  m = 0,
+                  d = 0,
+                  H = 0,
+                  M = 0,
+                  S = 0;
+               if (sscanf (refdate, "%d-%d-%d %d:%d:%d", &y, &m, &d, &H, &M, &S) >= 3)
                {
-                  struct sockaddr_in6 dest_addr = { 0 };
-                  inet6_aton (refdate, &dest_addr.sin6_addr);
-                  dest_addr.sin6_family = AF_INET6;
-                  dest_addr.sin6_port = htons (161);
-                  //dest_addr.sin6_scope_id = esp_netif_get_netif_impl_index(EXAMPLE_INTERFACE);
-                  int sock = socket (AF_INET6, SOCK_DGRAM, IPPROTO_IPV6);
-                  if (sock < 0)
-                     ESP_LOGE (TAG, "SNMP sock failed %s", refdate);
-                  else
+                  t.tm_year = (y ? : year) - 1900;
+                  t.tm_mon = m - 1;
+                  t.tm_mday = d;
+                  t.tm_hour = H;
+                  t.tm_min = M;
+                  t.tm_sec = S;
+                  t.tm_isdst = -1;
+                  int s = mktime (&t) - now;
+                  if (s < 0 && !y)
+                  {                // To next date
+                     t.tm_year++;
+                     t.tm_isdst = -1;
+                     s = mktime (&t) - now;
+                  }
+                  if (s < 0)
+                     s = -s;
+                  secs = s;
+                  snmp_target (NULL);
+               } else
+               {                   // Uptime from SNMP, polled by the SNMP task
+                  snmp_target (refdate);
+                  snmp_value_t v;
+                  if (!snmp_get (snmpup, &v) && v.when + SNMPSTALE >= up)
                   {
-                     // very crude IPv6 SNMP uptime .1.3.6.1.2.1.1.3.0
-                     uint8_t payload[] = {      // iso.3.6.1.2.1.1.3.0 iso.3.6.1.2.1.1.5.0 iso.3.6.1.2.1.1.1.0
-                        0x30, 0x45, 0x02, 0x01, 0x01, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6c, 0x69, 0x63, 0xa0, 0x38, 0x02,
-                        0x04, 0x00, 0x00, 0x00, 0x0, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x2a, 0x30, 0x0c, 0x06,
-                        0x08, 0x2b, 0x06, 0x01, 0x02, 0x01, 0x01, 0x03, 0x00, 0x05, 0x00, 0x30, 0x0c, 0x06, 0x08, 0x2b,
-                        0x06, 0x01, 0x02, 0x01, 0x01, 0x05, 0x00, 0x05, 0x00, 0x30, 0x0c, 0x06, 0x08, 0x2b, 0x06, 0x01,
-                        0x02, 0x01, 0x01, 0x01, 0x00, 0x05, 0x00
-                     };
-                     uint32_t id = ((esp_random () & 0x7FFFFF7F) | 0x40000040); // bodge to ensure 4 bytes
-                     *(uint32_t *) (payload + 17) = id;
-                     int err = sendto (sock, payload, sizeof (payload), 0, (struct sockaddr *) &dest_addr, sizeof (dest_addr));
-                     if (err < 0)
-                        ESP_LOGE (TAG, "SNMP Tx failed");
-                     else
-                     {
-                        struct timeval timeout;
-                        timeout.tv_sec = 1;
-                        timeout.tv_usec = 0;
-                        setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-                        uint8_t rx[300];
-                        struct sockaddr_storage source_addr;
-                        socklen_t socklen = sizeof (source_addr);
-                        uint64_t a = esp_timer_get_time ();
-                        int len = recvfrom (sock, rx, sizeof (rx), 0, (struct sockaddr *) &source_addr, &socklen);
-                        uint64_t b = esp_timer_get_time ();
-                        ESP_LOGE (TAG, "SNMP len %d (%llums)", len, (b - a) / 1000ULL);
-                        uint8_t *oid = NULL,
-                           oidlen = 0,
-                           resp = 0;
-                        uint8_t *scan (uint8_t * p, uint8_t * e)
+                     secs = v.n / 100 + (up - v.when);
+                     if (v.when != snmpwhen)
+                        perf_add (PERF_SNMP, v.rtt * 1000);     // New reply
+                     snmpwhen = v.when;
+                  }
+                  if (!snmp_get (snmpname, &v))
+                     strncpy (snmphost, v.s, sizeof (snmphost) - 1);
+                  if (!snmp_get (snmpdescr, &v))
+                  {
+                     char *d = v.s;
+                     if (fbversion)
+                     {             // Just the version in brackets
+                        char *o = strchr (d, '(');
+                        if (o)
                         {
-                           if (p >= e)
-                              return NULL;
-                           uint8_t class = (*p >> 6);
-                           uint8_t con = (*p & 0x20);
-                           uint32_t tag = 0;
-                           if ((*p & 0x1F) != 0x1F)
-                              tag = (*p & 0x1F);
-                           else
-                           {
-                              do
-                              {
-                                 p++;
-                                 tag = (tag << 7) | (*p & 0x7F);
-                              }
-                              while (*p & 0x80);
-                           }
-                           p++;
-                           if (p >= e)
-                              return NULL;
-                           uint32_t len = 0;
-                           if (*p & 0x80)
-                           {
-                              uint8_t b = (*p++ & 0x7F);
-                              while (b--)
-                                 len = (len << 8) + (*p++);
-                           } else
-                              len = (*p++ & 0x7F);
-                           if (p + len > e)
-                              return NULL;
-                           if (con)
+                           char *q = ++o;
+                           while (*q && *q != ')' && *q != ' ')
+                              q++;
+                           if (q > o)
                            {
-                              if (tag == 2)
-                                 resp = 1;
-                              while (p && p < e)
-                                 p = scan (p, e);
-                              oidlen = 0;
-                           } else
-                           {
-                              int32_t n = 0;
-                              uint8_t *d = p;
-                              uint8_t *de = p + len;
-                              if (!class && tag == 6)
-                              {
-                                 oid = p;
-                                 oidlen = len;
-                              }
-                              if ((!class && tag == 2) || (class == 1 && tag == 3))
-                              { // Int or timeticks
-                                 int s = 1;
-                                 if (*d & 0x80)
-                                    s = -1;
-                                 n = (*d++ & 0x7F);
-                                 while (d < de)
-                                    n = (n << 8) + *d++;
-                                 n *= s;
-                              }
-                              if (class == 2 && tag == 1 && resp)
-                              { // Response ID (first number in con tag 2)
-                                 resp = 0;
-                                 if (n != id)
-                                 {
-                                    ESP_LOGE (TAG, "SNMP Bad ID %08lX expecting %08lX", n, id);
-                                    return NULL;
-                                 }
-                              } else if (class == 1 && tag == 3 && oidlen == 8 && !memcmp (oid, (uint8_t[])
-                                                                                           {
-                                                                                           0x2b, 0x06, 0x01, 0x02, 0x01, 0x01, 0x03,
-                                                                                           0x00}
-                                                                                           , 8))
-                                 secs = n / 100;        // Uptime
-                              else if (!class && tag == 4 && oidlen == 8 && !memcmp (oid, (uint8_t[])
-                                                                                     {
-                                                                                     0x2b, 0x06, 0x01, 0x02, 0x01, 0x01, 0x05, 0x00}
-                                                                                     , 8))
-                              {
-                                 if (len > sizeof (snmphost) - 1)
-                                    len = sizeof (snmphost) - 1;
-                                 memcpy (snmphost, d, len);
-                                 snmphost[len] = 0;
-                              } else if (!class && tag == 4 && oidlen == 8 && !memcmp (oid, (uint8_t[])
-                                                                                       {
-                                                                                       0x2b, 0x06, 0x01, 0x02, 0x01, 0x01, 0x01,
-                                                                                       0x00}
-                                                                                       , 8))
-                              {
-                                 if (fbversion)
-                                 {
-                                    uint8_t *v = d;
-                                    while (v + 1 < de && *v != '(')
-                                       v++;
-                                    if (v < de)
-                                    {
-                                       v++;
-                                       uint8_t *q = v;
-                                       while (q < de && *q != ')' && *q != ' ')
-                                          q++;
-                                       if (q > v)
-                                       {
-                                          d = v;
-                                          len = q - v;
-                                       }
-                                    }
-                                 }
-                                 if (len > sizeof (snmpdesc) - 1)
-                                    len = sizeof (snmpdesc) - 1;
-                                 memcpy (snmpdesc, d, len);
-                                 snmpdesc[len] = 0;
-                              }
-                              p = de;
+                              *q = 0;
+                              d = o;
                            }
-                           return p;
                         }
-                        if (len > 0)
-                           scan (rx, rx + len);
                      }
-                     close (sock);
+                     strncpy (snmpdesc, d, sizeof (snmpdesc) - 1);
                   }
-                  if (secs)
-                     break;     // Got reply
                }
-            }
-            // Show days, 4 sig fig
-            if (!secs)
-               gfx_7seg (s, "----");
-            else if (secs < 86400 && s * (6 + 7 + 6 + 6) <= gfx_width ())
-               gfx_7seg (s, "%02lld:%02lld", secs / 3600, secs % 3600 / 60);
-            else if (secs < 864000)
-               gfx_7seg (s, "%lld.%03lld", secs / 86400, secs % 86400 * 10 / 864);
-            else if (secs < 8640000)
-               gfx_7seg (s, "%lld.%02lld", secs / 86400, secs % 86400 / 864);
-            else if (secs < 86400000)
-               gfx_7seg (s, "%lld.%lld", secs / 86400, secs % 86400 / 8640);
-            else if (secs < 864000000)
-               gfx_7seg (s, "%lld", secs / 86400);
+               // Show days, 4 sig fig
+               if (!secs)
+                  widget_set (W_TIME, "----");
+               else if (secs < 86400 && s * (6 + 7 + 6 + 6) <= gfx_width ())
+                  widget_set (W_TIME, "%02lld:%02lld", secs / 3600, secs % 3600 / 60);
+               else if (secs < 864000)
+                  widget_set (W_TIME, "%lld.%03lld", secs / 86400, secs % 86400 * 10 / 864);
+               else if (secs < 8640000)
+                  widget_set (W_TIME, "%lld.%02lld", secs / 86400, secs % 86400 / 864);
+               else if (secs < 86400000)
+                  widget_set (W_TIME, "%lld.%lld", secs / 86400, secs % 86400 / 8640);
+               else if (secs < 864000000)
+                  widget_set (W_TIME, "%lld", secs / 86400);
+               else
+                  widget_set (W_TIME, "9999");
+            } else if (s * (6 * 15 + 1) <= gfx_width ())   // Datetime fits
+               widget_set (W_TIME, "%04d-%02d-%02d %02d:%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour,
+                          t.tm_min);
             else
-               gfx_7seg (s, "9999");
-         } else if (s * (6 * 15 + 1) <= gfx_width ())   // Datetime fits
-            gfx_7seg (s, "%04d-%02d-%02d %02d:%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min);
-         else
-            gfx_7seg (s, "%02d:%02d", t.tm_hour, t.tm_min);
+               widget_set (W_TIME, "%02d:%02d", t.tm_hour, t.tm_min);
+            if (snmp != esp_rom_crc32_le (esp_rom_crc32_le (0, (uint8_t *) snmphost, sizeof (snmphost)),
+                                          (uint8_t *) snmpdesc, sizeof (snmpdesc)))
+               widgetdeps |= DEP_SNMP;
+         }
+         ov_7seg (s, "%s", widget_text (W_TIME));
          y -= s * 10;
       }
       if (showhost)
       {
          int s = start (showhost);
-         gfx_text (-s, snmphost);
+         if (widget_stale (W_HOST))
+            widget_set (W_HOST, "%s", snmphost);
+         ov_text (-s, "%s", widget_text (W_HOST));
          y -= s * 10;
       }
       if (showdesc)
       {
          int s = start (showdesc);
-         gfx_text (-s, snmpdesc);
+         if (widget_stale (W_DESC))
+            widget_set (W_DESC, "%s", snmpdesc);
+         ov_text (-s, "%s", widget_text (W_DESC));
          y -= s * 10;
       }
       if (showday)
       {
          int s = start (showday);
-         gfx_text (s, longday[t.tm_wday]);
+         if (widget_stale (W_DAY))
+            widget_set (W_DAY, "%s", longday[t.tm_wday]);
+         ov_text (s, "%s", widget_text (W_DAY));
          y -= s * 8;
       }
       if (showdefcon)
       {
          int s = start (showdefcon);
-         if (defcon < 0 || defcon > 5)
-            gfx_7seg (s, "-");
-         else
-            gfx_7seg (s, "%d", defcon);
+         if (widget_stale (W_DEFCON))
+         {
+            if (defcon < 0 || defcon > 5)
+               widget_set (W_DEFCON, "-");
+            else
+               widget_set (W_DEFCON, "%d", defcon);
+         }
+         ov_7seg (s, "%s", widget_text (W_DEFCON));
          y -= s * 10;
       }
 #ifdef	CONFIG_REVK_SOLAR
       if (showset && (poslat || poslon))
       {
          int s = start (showset);
-         time_t when = sun_set (t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, (double) poslat / poslat_scale,
-                                (double) poslon / poslon_scale, SUN_DEFAULT);
-         if (!now)
-            when = 0;
-         struct tm tm = { 0 };
-         localtime_r (&when, &tm);
-         gfx_7seg (s, "%02d:%02d", tm.tm_hour, tm.tm_min);
+         if (widget_stale (W_SET))
+         {
+            time_t when = sun_set (t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, (double) poslat / poslat_scale,
+                                   (double) poslon / poslon_scale, SUN_DEFAULT);
+            if (!now)
+               when = 0;
+            struct tm tm = { 0 };
+            localtime_r (&when, &tm);
+            widget_set (W_SET, "%02d:%02d", tm.tm_hour, tm.tm_min);
+         }
+         ov_7seg (s, "%s", widget_text (W_SET));
          y -= s * 10;
       }
       if (showrise && (poslat || poslon))
       {
          int s = start (showrise);
-         time_t when = sun_rise (t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, (double) poslat / poslat_scale,
-                                 (double) poslon / poslon_scale, SUN_DEFAULT);
-         if (!now)
-            when = 0;
-         struct tm tm = { 0 };
-         localtime_r (&when, &tm);
-         gfx_7seg (s, "%02d:%02d", tm.tm_hour, tm.tm_min);
+         if (widget_stale (W_RISE))
+         {
+            time_t when = sun_rise (t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, (double) poslat / poslat_scale,
+                                    (double) poslon / poslon_scale, SUN_DEFAULT);
+            if (!now)
+               when = 0;
+            struct tm tm = { 0 };
+            localtime_r (&when, &tm);
+            widget_set (W_RISE, "%02d:%02d", tm.tm_hour, tm.tm_min);
+         }
+         ov_7seg (s, "%s", widget_text (W_RISE));
          y -= s * 10;
       }
 #endif
@@ -1078,11 +3390,13 @@ app_main ()
             if (showqr)
             {
                if (showpass && LEFT)
-                  gfx_pos (showqr, gfx_y (), gfx_a ());
+                  ov_pos (showqr, ov_y (), ov_a ());
                else if (showpass & RIGHT)
-                  gfx_pos (gfx_width () - showqr - 1, gfx_y (), gfx_a ());
+                  ov_pos (gfx_width () - showqr - 1, ov_y (), ov_a ());
             }
-            gfx_text (-s, thispass);
+            if (widget_stale (W_PASS))
+               widget_set (W_PASS, "%s", thispass);
+            ov_text (-s, "%s", widget_text (W_PASS));
             y -= s * 10;
             h += s * 10;
          }
@@ -1092,32 +3406,102 @@ app_main ()
             if (showqr)
             {
                if (showssid & LEFT)
-                  gfx_pos (showqr, gfx_y (), gfx_a ());
+                  ov_pos (showqr, ov_y (), ov_a ());
                else if (showssid & RIGHT)
-                  gfx_pos (gfx_width () - showqr - 1, gfx_y (), gfx_a ());
+                  ov_pos (gfx_width () - showqr - 1, ov_y (), ov_a ());
             }
-            gfx_text (-s, thisssid);
+            if (widget_stale (W_SSID))
+               widget_set (W_SSID, "%s", thisssid);
+            ov_text (-s, "%s", widget_text (W_SSID));
             y -= s * 10;
             h += s * 10;
          }
          if (showqr)
          {                      // QR
             y = yy;             // Rewind
-            char *qr;
-            if (*pass)
-               asprintf (&qr, "WIFI:S:%s;T:WPA2;P:%s;;", thisssid, thispass);
-            else
-               asprintf (&qr, "WIFI:S:%s;;", thisssid);
-            gfx_pos (((showssid | showpass) & LEFT) ? 0 : gfx_width () - 1, y,
-                     GFX_B | (((showssid | showpass) & LEFT) ? GFX_L : GFX_R));
-            if (qr)
-               gfx_qr (qr, showqr);
-            free (qr);
+            if (widget_stale (W_QR))
+            {
+               if (*pass)
+                  widget_set (W_QR, "WIFI:S:%s;T:WPA2;P:%s;;", thisssid, thispass);
+               else
+                  widget_set (W_QR, "WIFI:S:%s;;", thisssid);
+            }
+            ov_pos (((showssid | showpass) & LEFT) ? 0 : gfx_width () - 1, y,
+                    GFX_B | (((showssid | showpass) & LEFT) ? GFX_L : GFX_R));
+            ov_qr (widget_text (W_QR), showqr);
             y -= (h > showqr ? h : showqr);
          }
       }
       start (0);
-      gfx_unlock ();
+      uint8_t full = 0;
+      uint8_t quiet = (!gfxnight || (t.tm_hour >= 2 && t.tm_hour < 4));
+      int worst = ghost_worst ();
+      if (refresh && now / refresh != fresh)
+      {                         // Periodic refresh, e.g.once a day, if anything has changed
+         fresh = now / refresh;
+         if (ghostn)
+            full = 1;
+      } else if (file && file->new)
+      {
+         file->new = 0;
+         if (gfxnight && t.tm_hour >= 2 && t.tm_hour < 4)
+            full = 1;           // Full update
+      }
+      if (worst >= 200 || (worst >= 100 && quiet))
+         full = 1;              // Ghosting budget used, wait for quiet hours unless well over
+      if (gfxena.set && !panelon && ov_changed ())
+         full = 1;              // Panel lost state when powered off
+      if (full || ov_changed ())
+      {
+         gfx_pos_t rt,
+           rb;
+         panel_power (1);
+         gfx_lock ();
+         if (full)
+         {
+            if (ghostn)
+            {
+               jo_t j = jo_object_alloc ();
+               jo_int (j, "partial", ghostn);
+               jo_int (j, "budget", worst);
+               revk_info ("refresh", &j);
+            }
+            gfx_refresh ();
+            ghost_clear ();
+         } else
+            ghost_add ();
+         if (!full && ov_region (&rt, &rb))
+            ov_draw_rows (rt, rb);      // Just the text that changed, e.g. DEFCON
+         else
+            ov_draw ();
+         uint32_t hash = (file ? file->hash : 0);
+         xSemaphoreGive (image_mutex);  // Frame is drawn, so image can change while panel updates
+         updated = esp_timer_get_time ();
+         int64_t start = esp_timer_get_time ();
+         gfx_unlock ();
+         perf_since (PERF_UPDATE, start);
+         if (gated ())
+         {                      // Only powered to update
+            panel_idle ();
+            panel_power (0);
+         }
+         if (!content)
+         {                      // Time to first content
+            content = esp_timer_get_time ();
+            jo_t j = jo_object_alloc ();
+            if (restored)
+               jo_int (j, "restoredms", restored / 1000LL);
+            jo_int (j, "contentms", content / 1000LL);
+            revk_info ("boot", &j);
+         }
+         if (up >= framedue || hash != framehash)
+         {                      // Keep for power on
+            frame_save ();
+            framedue = up + FRAMESAVE;
+            framehash = hash;
+         }
+      } else
+         xSemaphoreGive (image_mutex);
    }
 }
 
@@ -1126,11 +3510,18 @@ revk_web_extra (httpd_req_t * req)
 {
    revk_web_setting_title (req, "Main image settings");
    revk_web_setting_info (req,
-                          "Background image at URL should be 1 bit per pixel raw data for the image. See <a href='https://github.com/revk/ESP32-RevK/blob/master/Manuals/Seasonal.md'>season code</a>.");
+                          "Background image at URL should be PNG, or native 1 bit per pixel data for the display. See <a href='https://github.com/revk/ESP32-RevK/blob/master/Manuals/Seasonal.md'>season code</a>.");
    revk_web_setting (req, "Startup", "startup");
    revk_web_setting (req, "Image URL", "imageurl");
+   revk_web_setting (req, "Image upload", "imageupload");
    revk_web_setting (req, "Image check", "recheck");
+   revk_web_setting (req, "Missing image check", "missing");
    revk_web_setting (req, "Image invert", "gfxinvert");
+   revk_web_setting (req, "Power on clean", "gfxclean");
+   revk_web_setting (req, "Low power", "lowpower");
+   revk_web_setting (req, "Redraw hold", "redrawhold");
+   revk_web_setting (req, "Min update interval", "redrawmin");
+   revk_web_setting (req, "Ghosting budget", "ghostbudget");
    if (rgb.set && leds > 1)
    {
       revk_web_setting_title (req, "LEDs");
@@ -0,0 +1,121 @@
+/* EPDSign image planes */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Decoded images are kept as 1 bit per pixel planes, and drawn as runs
+// Header only, so test/pixelbench can use it on a host
+
+#if defined(CONFIG_GFX_BUILD_SUFFIX_EPD75R) || defined(CONFIG_GFX_BUILD_SUFFIX_EPD154R)
+#define	PLANES_RED              // Display has red ink
+#endif
+
+typedef struct planes_s
+{
+   uint32_t w;                  // Stored width
+   uint32_t h;                  // Stored height
+   uint32_t line;               // Bytes per row
+   uint8_t *bits;               // Pixels, 1 for white
+   uint8_t *mask;               // Opaque pixels
+   uint8_t *red;                // Red pixels
+} planes_t;
+
+#ifdef	PLANES_RED
+enum
+{                               // Inks
+   INK_BLACK,
+   INK_WHITE,
+   INK_RED,
+};
+
+static uint8_t inklut[4096];    // Ink for RGB, 4 bits each
+static uint8_t inkready = 0;
+
+static void
+planes_ink (void)
+{                               // Nearest ink for each colour
+   if (inkready)
+      return;
+   static const uint8_t inks[][3] = {
+      [INK_BLACK] = {0, 0, 0},
+      [INK_WHITE] = {255, 255, 255},
+      [INK_RED] = {255, 0, 0},
+   };
+   for (int n = 0; n < 4096; n++)
+   {
+      int c[3] = { (n >> 8) * 17, ((n >> 4) & 15) * 17, (n & 15) * 17 };
+      uint32_t best = -1;
+      for (int i = 0; i < sizeof (inks) / sizeof (*inks); i++)
+      {
+         uint32_t d = 0;
+         for (int q = 0; q < 3; q++)
+            d += (c[q] - inks[i][q]) * (c[q] - inks[i][q]);
+         if (d < best)
+         {                      // Ties go to the first, so greys are never red
+            best = d;
+            inklut[n] = i;
+         }
+      }
+   }
+   inkready = 1;
+}
+
+static inline uint8_t
+planes_inkof (uint16_t r, uint16_t g, uint16_t b)
+{                               // Ink for 16 bit RGB
+   return inklut[((r >> 4) & 0xF00) | ((g >> 8) & 0xF0) | (b >> 12)];
+}
+#endif
+
+static inline uint32_t
+planes_word (const uint8_t * p)
+{                               // 32 pixels, leftmost in bit 31
+   return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+planes_blit (const uint8_t * p, uint32_t w, uint32_t h, uint32_t line, gfx_pos_t ox, gfx_pos_t oy, gfx_pos_t clipt,
+             gfx_pos_t clipb)
+{                               // Fill runs of set pixels in current colour, rows clipt to clipb
+   // Runs are found a word at a time, and identical rows are filled as one box, as gfx_fill() is all GFX offers
+   void fill (uint32_t y, uint32_t rows, uint32_t s, uint32_t e)
+   {
+      if (e > w)
+         e = w;
+      if (e <= s)
+         return;
+      gfx_pos (ox + s, oy + y, GFX_L | GFX_T);
+      gfx_fill (e - s, rows, 255);
+   }
+   for (uint32_t y = 0; y < h; y++)
+   {
+      if (oy + (int) y < clipt || oy + (int) y > clipb)
+         continue;
+      const uint8_t *r = p + y * line;
+      uint32_t rows = 1;
+      while (y + rows < h && oy + (int) (y + rows) <= clipb && !memcmp (r, r + rows * line, line))
+         rows++;
+      uint32_t s = 0;
+      uint8_t in = 0;
+      for (uint32_t x = 0; x < w; x += 32)
+      {
+         uint32_t v = planes_word (r + x / 8);
+         if (v == (in ? 0xFFFFFFFF : 0))
+            continue;           // Whole word continues run, or gap
+         uint32_t b = 0;
+         while (b < 32)
+         {
+            uint32_t t = (in ? ~v : v) << b;
+            if (!t)
+               break;
+            b += __builtin_clz (t);
+            if (in)
+               fill (y, rows, s, x + b);
+            else
+               s = x + b;
+            in = !in;
+         }
+      }
+      if (in)
+         fill (y, rows, s, w);
+      y += rows - 1;
+   }
+}
@@ -0,0 +1,321 @@
+/* EPDSign SNMP client */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+static const char TAG[] = "SNMP";
+
+#include "revk.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include "snmp.h"
+
+#ifndef	SNMP_PORT
+#define	SNMP_PORT	"161"   // Agent port
+#endif
+#define	SNMP_TRIES	3       // Sends before giving up on a poll
+#define	SNMP_WAIT	1       // Seconds to wait for a reply before sending again
+
+typedef struct snmp_target_s
+{
+   char *host;                  // Host as watched (malloc'd), NULL if slot unused
+   struct sockaddr_storage addr;        // Resolved address
+   socklen_t addrlen;           // Address length, 0 if not resolved
+   int sock;                    // Socket, -1 if none
+   uint32_t id;                 // Outstanding request ID
+   uint32_t next;               // Uptime to send next
+   int64_t sent;                // When sent (us)
+   uint8_t tries;               // Sends of outstanding request
+   uint8_t count;               // OIDs
+   snmp_oid_t oid[SNMP_OIDS];   // OIDs to get
+   snmp_value_t value[SNMP_OIDS];       // Latest values
+} snmp_target_t;
+
+static snmp_target_t targets[SNMP_TARGETS] = { 0 };
+
+static SemaphoreHandle_t snmp_mutex = NULL;
+static uint32_t snmp_interval = 60;
+
+// Polling
+
+static void
+target_close (snmp_target_t * t)
+{
+   if (t->sock >= 0)
+      close (t->sock);
+   t->sock = -1;
+   t->addrlen = 0;
+}
+
+static void
+target_resolve (void)
+{                               // Resolve targets due a send, without holding the mutex, as DNS can be slow
+   for (int n = 0; n < SNMP_TARGETS; n++)
+   {
+      snmp_target_t *t = &targets[n];
+      char *host = NULL;
+      xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+      if (t->host && t->count && !t->addrlen && uptime () >= t->next)
+         host = strdup (t->host);
+      xSemaphoreGive (snmp_mutex);
+      if (!host)
+         continue;
+      struct addrinfo hints = {.ai_socktype = SOCK_DGRAM };
+      struct addrinfo *res = NULL;
+      if (getaddrinfo (host, SNMP_PORT, &hints, &res) || !res)
+      {
+         ESP_LOGE (TAG, "Cannot resolve %s", host);
+         res = NULL;
+      }
+      xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+      if (res && t->host && !strcmp (t->host, host) && !t->addrlen && res->ai_addrlen <= sizeof (t->addr))
+      {                         // Still the same target
+         memcpy (&t->addr, res->ai_addr, res->ai_addrlen);
+         t->addrlen = res->ai_addrlen;
+      }
+      xSemaphoreGive (snmp_mutex);
+      if (res)
+         freeaddrinfo (res);
+      free (host);
+   }
+}
+
+static void
+target_send (snmp_target_t * t)
+{                               // Send (or resend) request, a target that did not resolve counts as a try
+   if (!t->tries)
+      t->id = ((esp_random () & 0x7FFFFFFF) | 1);
+   if (!t->addrlen)
+   {
+      t->tries++;
+      return;
+   }
+   if (t->sock < 0)
+   {
+      t->sock = socket (t->addr.ss_family, SOCK_DGRAM, 0);
+      if (t->sock < 0)
+      {
+         ESP_LOGE (TAG, "Socket failed %s", t->host);
+         t->tries++;
+         return;
+      }
+      fcntl (t->sock, F_SETFL, fcntl (t->sock, F_GETFL, 0) | O_NONBLOCK);
+   }
+   uint8_t buf[SNMP_PKTMAX];
+   int len = snmp_encode_get (buf, sizeof (buf), "public", t->id, t->count, t->oid);
+   if (len < 0)
+      return;
+   t->tries++;
+   t->sent = esp_timer_get_time ();
+   if (sendto (t->sock, buf, len, 0, (struct sockaddr *) &t->addr, t->addrlen) < 0)
+   {
+      ESP_LOGE (TAG, "Tx failed %s", t->host);
+      target_close (t);         // Resolve again next time
+   }
+}
+
+static void
+target_varbind (void *arg, const uint8_t * oid, uint32_t oidlen, uint8_t tag, const uint8_t * value, uint32_t len)
+{
+   snmp_target_t *t = arg;
+   int n;
+   for (n = 0; n < t->count && (t->oid[n].len != oidlen || memcmp (t->oid[n].oid, oid, oidlen)); n++);
+   if (n == t->count || tag == 0x05 || tag >= 0x80)
+      return;                   // Not ours, or noSuchObject, etc
+   snmp_value_t *v = &t->value[n];
+   v->when = uptime ();
+   v->rtt = (esp_timer_get_time () - t->sent) / 1000;
+   v->tag = tag;
+   v->n = 0;
+   *v->s = 0;
+   if (tag == 0x04)
+   {
+      if (len > sizeof (v->s) - 1)
+         len = sizeof (v->s) - 1;
+      memcpy (v->s, value, len);
+      v->s[len] = 0;
+   } else
+      v->n = snmp_integer (tag, value, len);
+}
+
+static void
+target_recv (snmp_target_t * t)
+{
+   uint8_t buf[SNMP_PKTMAX];
+   int len;
+   while ((len = recv (t->sock, buf, sizeof (buf), 0)) > 0)
+   {
+      if (!t->tries)
+         continue;              // Late reply
+      const char *e = snmp_decode (buf, len, t->id, target_varbind, t);
+      if (e)
+         ESP_LOGE (TAG, "%s %s", t->host, e);
+      else
+      {                         // Done
+         t->tries = 0;
+         t->next = uptime () + snmp_interval;
+      }
+   }
+}
+
+static int
+snmp_due (fd_set * r)
+{                               // Send polls and retries that are due, setting r for sockets to wait on, returns max socket or -1
+   target_resolve ();
+   FD_ZERO (r);
+   int max = -1;
+   uint32_t now = uptime ();
+   xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+   for (int n = 0; n < SNMP_TARGETS; n++)
+   {
+      snmp_target_t *t = &targets[n];
+      if (!t->host || !t->count)
+         continue;
+      if (t->tries && now >= t->next)
+      {                         // No reply in time
+         if (t->tries >= SNMP_TRIES)
+         {
+            ESP_LOGE (TAG, "No reply %s", t->host);
+            t->tries = 0;
+            t->next = now + snmp_interval;
+         } else
+         {
+            target_send (t);
+            t->next = now + SNMP_WAIT;
+         }
+      } else if (!t->tries && now >= t->next)
+      {                         // Time to poll
+         target_send (t);
+         t->next = now + (t->tries ? SNMP_WAIT : snmp_interval);
+      }
+      if (t->sock >= 0)
+      {
+         FD_SET (t->sock, r);
+         if (t->sock > max)
+            max = t->sock;
+      }
+   }
+   xSemaphoreGive (snmp_mutex);
+   return max;
+}
+
+static void
+snmp_rx (fd_set * r)
+{                               // Handle replies on sockets set in r
+   xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+   for (int n = 0; n < SNMP_TARGETS; n++)
+   {
+      snmp_target_t *t = &targets[n];
+      if (t->host && t->sock >= 0 && FD_ISSET (t->sock, r))
+         target_recv (t);
+   }
+   xSemaphoreGive (snmp_mutex);
+}
+
+static void
+snmp_task (void *arg)
+{
+   while (1)
+   {
+      fd_set r;
+      int max = snmp_due (&r);
+      if (max < 0)
+      {
+         sleep (1);
+         continue;
+      }
+      struct timeval tv = {.tv_sec = 1 };
+      if (select (max + 1, &r, NULL, NULL, &tv) > 0)
+         snmp_rx (&r);
+   }
+}
+
+void
+snmp_init (uint32_t interval)
+{
+   if (snmp_mutex)
+      return;
+   if (interval)
+      snmp_interval = interval;
+   for (int n = 0; n < SNMP_TARGETS; n++)
+      targets[n].sock = -1;
+   snmp_mutex = xSemaphoreCreateMutex ();
+   revk_task (TAG, snmp_task, NULL, 4);
+}
+
+int
+snmp_watch (const char *host, const char *oid)
+{
+   if (!snmp_mutex || !host || !*host)
+      return -1;
+   snmp_oid_t o = { 0 };
+   int l = snmp_oid (o.oid, sizeof (o.oid), oid);
+   if (l < 0)
+      return -1;
+   o.len = l;
+   int handle = -1;
+   xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+   int n,
+     f = -1;
+   for (n = 0; n < SNMP_TARGETS && (!targets[n].host || strcmp (targets[n].host, host)); n++)
+      if (f < 0 && !targets[n].host)
+         f = n;
+   if (n == SNMP_TARGETS && f >= 0)
+   {                            // New target
+      n = f;
+      snmp_target_t *t = &targets[n];
+      memset (t, 0, sizeof (*t));
+      t->sock = -1;
+      t->host = strdup (host);
+   }
+   if (n < SNMP_TARGETS && targets[n].host)
+   {
+      snmp_target_t *t = &targets[n];
+      int i;
+      for (i = 0; i < t->count && (t->oid[i].len != o.len || memcmp (t->oid[i].oid, o.oid, o.len)); i++);
+      if (i == t->count && i < SNMP_OIDS)
+      {
+         t->oid[t->count++] = o;
+         t->tries = 0;
+         t->next = 0;           // Poll now
+      }
+      if (i < t->count)
+         handle = n * SNMP_OIDS + i;
+   }
+   xSemaphoreGive (snmp_mutex);
+   return handle;
+}
+
+void
+snmp_forget (const char *host)
+{
+   if (!snmp_mutex || !host)
+      return;
+   xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+   for (int n = 0; n < SNMP_TARGETS; n++)
+      if (targets[n].host && !strcmp (targets[n].host, host))
+      {
+         target_close (&targets[n]);
+         free (targets[n].host);
+         targets[n].host = NULL;
+         targets[n].count = 0;
+      }
+   xSemaphoreGive (snmp_mutex);
+}
+
+int
+snmp_get (int handle, snmp_value_t * v)
+{
+   if (!snmp_mutex || handle < 0 || handle >= SNMP_TARGETS * SNMP_OIDS)
+      return -1;
+   int r = -1;
+   xSemaphoreTake (snmp_mutex, portMAX_DELAY);
+   snmp_target_t *t = &targets[handle / SNMP_OIDS];
+   if (t->host && handle % SNMP_OIDS < t->count && t->value[handle % SNMP_OIDS].when)
+   {
+      *v = t->value[handle % SNMP_OIDS];
+      r = 0;
+   }
+   xSemaphoreGive (snmp_mutex);
+   return r;
+}
@@ -0,0 +1,54 @@
+/* EPDSign SNMP client */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Polls SNMP v2c targets from its own task, so nothing waits on a slow or dead agent
+// Each target can have several OIDs, which are requested in one GetRequest
+// The latest value for each is kept, with when it arrived
+
+#define	SNMP_TARGETS	4       // Max targets
+#define	SNMP_OIDS	8       // Max OIDs per target
+#define	SNMP_OIDMAX	32      // Max encoded OID length
+#define	SNMP_STRMAX	65      // Max string value (including null)
+#define	SNMP_PKTMAX	484     // Max packet size
+
+typedef struct snmp_value_s
+{
+   uint32_t when;               // Uptime value received, 0 if never
+   uint32_t rtt;                // Round trip time of reply (ms)
+   uint8_t tag;                 // BER tag of value
+   int64_t n;                   // Integer, counter, gauge, or timeticks value
+   char s[SNMP_STRMAX];         // String value
+} snmp_value_t;
+
+typedef struct snmp_oid_s
+{
+   uint8_t len;                 // Encoded length
+   uint8_t oid[SNMP_OIDMAX];    // Encoded OID
+} snmp_oid_t;
+
+// Start SNMP task, polling each target every interval seconds
+void snmp_init (uint32_t interval);
+
+// Poll OID (dotted, e.g. 1.3.6.1.2.1.1.3.0) on host (IPv4, IPv6, or name), returns handle, or -1 if no space
+int snmp_watch (const char *host, const char *oid);
+
+// Stop polling a host, its handles are no longer valid
+void snmp_forget (const char *host);
+
+// Latest value for handle, returns 0 if there is one
+int snmp_get (int handle, snmp_value_t * v);
+
+// BER encoding/decoding
+
+// Encode a dotted OID, returns length or -1 if not valid
+int snmp_oid (uint8_t * oid, size_t max, const char *dotted);
+
+// Make a GetRequest for oids, returns length or -1 if no space
+int snmp_encode_get (uint8_t * buf, size_t max, const char *community, uint32_t id, int count, const snmp_oid_t * oids);
+
+// Decode a GetResponse for request id, calling cb for each variable binding, returns NULL or error
+typedef void snmp_varbind_t (void *arg, const uint8_t * oid, uint32_t oidlen, uint8_t tag, const uint8_t * value, uint32_t len);
+const char *snmp_decode (const uint8_t * buf, size_t len, uint32_t id, snmp_varbind_t * cb, void *arg);
+
+// Integer value from BER content (signed for INTEGER, unsigned for application types)
+int64_t snmp_integer (uint8_t tag, const uint8_t * value, uint32_t len);
@@ -0,0 +1,217 @@
+/* EPDSign SNMP BER codec */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// No ESP-IDF dependencies, so this also builds on a host for test/snmptest
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "snmp.h"
+
+// BER encoding, done backwards from the end of the buffer so lengths are known when the header is added
+
+static uint8_t *
+ber_push (uint8_t * p, uint8_t * b, const void *v, size_t n)
+{
+   if (!p || p - b < n)
+      return NULL;
+   p -= n;
+   memcpy (p, v, n);
+   return p;
+}
+
+static uint8_t *
+ber_head (uint8_t * p, uint8_t * b, uint8_t tag, size_t len)
+{                               // Add tag and length before content
+   uint8_t h[4];
+   int n = 0;
+   h[n++] = tag;
+   if (len >= 0x100)
+   {
+      h[n++] = 0x82;
+      h[n++] = (len >> 8);
+   } else if (len >= 0x80)
+      h[n++] = 0x81;
+   h[n++] = len;
+   return ber_push (p, b, h, n);
+}
+
+static uint8_t *
+ber_int (uint8_t * p, uint8_t * b, int32_t v)
+{
+   uint8_t c[4];
+   int n = 4;
+   c[0] = (v >> 24);
+   c[1] = (v >> 16);
+   c[2] = (v >> 8);
+   c[3] = v;
+   const uint8_t *s = c;
+   while (n > 1 && ((s[0] == 0 && !(s[1] & 0x80)) || (s[0] == 0xFF && (s[1] & 0x80))))
+   {                            // Minimal two's complement
+      s++;
+      n--;
+   }
+   p = ber_push (p, b, s, n);
+   return ber_head (p, b, 0x02, n);
+}
+
+int
+snmp_oid (uint8_t * oid, size_t max, const char *dotted)
+{
+   uint32_t arc[SNMP_OIDMAX];
+   int n = 0;
+   const char *d = dotted;
+   if (*d == '.')
+      d++;
+   while (*d && n < SNMP_OIDMAX)
+   {
+      if (!isdigit ((int) (uint8_t) * d))
+         return -1;
+      arc[n++] = strtoul (d, (char **) &d, 10);
+      if (*d == '.')
+         d++;
+      else if (*d)
+         return -1;
+   }
+   if (*d || n < 2 || arc[0] > 2 || (arc[0] < 2 && arc[1] >= 40))
+      return -1;
+   arc[1] += arc[0] * 40;       // First two arcs share first byte
+   size_t len = 0;
+   for (int a = 1; a < n; a++)
+   {                            // Base 128, big endian, top bit set on all but last byte
+      uint8_t t[5];
+      int l = 0;
+      uint32_t v = arc[a];
+      do
+         t[l++] = (v & 0x7F);
+      while ((v >>= 7));
+      if (len + l > max)
+         return -1;
+      while (l--)
+         oid[len++] = t[l] | (l ? 0x80 : 0);
+   }
+   return len;
+}
+
+int
+snmp_encode_get (uint8_t * buf, size_t max, const char *community, uint32_t id, int count, const snmp_oid_t * oids)
+{
+   uint8_t *e = buf + max,
+      *p = e;
+   for (int n = count - 1; n >= 0; n--)
+   {                            // Variable bindings, OID with NULL value
+      uint8_t *vb = p;
+      p = ber_push (p, buf, "\x05\x00", 2);
+      p = ber_push (p, buf, oids[n].oid, oids[n].len);
+      p = ber_head (p, buf, 0x06, oids[n].len);
+      if (p)
+         p = ber_head (p, buf, 0x30, vb - p);
+   }
+   if (p)
+      p = ber_head (p, buf, 0x30, e - p);
+   p = ber_int (p, buf, 0);     // Error index
+   p = ber_int (p, buf, 0);     // Error status
+   p = ber_int (p, buf, id);    // Request ID
+   if (p)
+      p = ber_head (p, buf, 0xA0, e - p);       // GetRequest
+   p = ber_push (p, buf, community, strlen (community));
+   p = ber_head (p, buf, 0x04, strlen (community));
+   p = ber_int (p, buf, 1);     // v2c
+   if (p)
+      p = ber_head (p, buf, 0x30, e - p);
+   if (!p)
+      return -1;
+   memmove (buf, p, e - p);
+   return e - p;
+}
+
+// BER decoding
+
+static const uint8_t *
+ber_read (const uint8_t * p, const uint8_t * e, uint8_t * tag, const uint8_t ** v, uint32_t * len)
+{                               // Read a tag/length/value, returns next, or NULL if not valid
+   if (!p || p + 2 > e)
+      return NULL;
+   *tag = *p++;
+   if ((*tag & 0x1F) == 0x1F)
+      return NULL;              // High tag numbers are not used in SNMP
+   uint32_t l = *p++;
+   if (l & 0x80)
+   {
+      uint8_t n = (l & 0x7F);
+      if (!n || n > 4 || p + n > e)
+         return NULL;
+      l = 0;
+      while (n--)
+         l = (l << 8) | *p++;
+   }
+   if (l > e - p)
+      return NULL;
+   *v = p;
+   *len = l;
+   return p + l;
+}
+
+int64_t
+snmp_integer (uint8_t tag, const uint8_t * value, uint32_t len)
+{
+   if (!len || len > 9)
+      return 0;
+   uint64_t n = ((tag == 0x02 && (*value & 0x80)) ? -1 : 0);
+   while (len--)
+      n = (n << 8) | *value++;
+   return n;
+}
+
+const char *
+snmp_decode (const uint8_t * buf, size_t len, uint32_t id, snmp_varbind_t * cb, void *arg)
+{
+   const uint8_t *e = buf + len,
+      *v;
+   uint32_t l;
+   uint8_t tag;
+   if (!ber_read (buf, e, &tag, &v, &l) || tag != 0x30)
+      return "Bad message";
+   e = v + l;
+   const uint8_t *p = v;
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x02)
+      return "Bad version";
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x04)
+      return "Bad community";
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0xA2)
+      return "Not a response";
+   e = v + l;
+   p = v;
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x02)
+      return "Bad request ID";
+   if ((uint32_t) snmp_integer (tag, v, l) != id)
+      return "Wrong request ID";
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x02)
+      return "Bad error status";
+   if (snmp_integer (tag, v, l))
+      return "Error status";
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x02)
+      return "Bad error index";
+   if (!(p = ber_read (p, e, &tag, &v, &l)) || tag != 0x30)
+      return "Bad bindings";
+   e = v + l;
+   p = v;
+   while (p < e)
+   {
+      const uint8_t *vb;
+      uint32_t vblen;
+      if (!(p = ber_read (p, e, &tag, &vb, &vblen)) || tag != 0x30)
+         return "Bad binding";
+      const uint8_t *oid,
+       *q;
+      uint32_t oidlen;
+      if (!(q = ber_read (vb, vb + vblen, &tag, &oid, &oidlen)) || tag != 0x06)
+         return "Bad OID";
+      if (!ber_read (q, vb + vblen, &tag, &v, &l))
+         return "Bad value";
+      cb (arg, oid, oidlen, tag, v, l);
+   }
+   return NULL;
+}
@@ -0,0 +1,12 @@
+/* EPDSign host stand-in for esp_timer */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+#include <time.h>
+
+static inline int64_t
+esp_timer_get_time (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
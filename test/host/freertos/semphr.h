@@ -0,0 +1,19 @@
+/* EPDSign host stand-in for FreeRTOS mutexes */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+#include <pthread.h>
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+#define	portMAX_DELAY	0
+
+static inline SemaphoreHandle_t
+xSemaphoreCreateMutex (void)
+{
+   SemaphoreHandle_t m = malloc (sizeof (*m));
+   if (m)
+      pthread_mutex_init (m, NULL);
+   return m;
+}
+
+#define	xSemaphoreTake(m,t)	pthread_mutex_lock(m)
+#define	xSemaphoreGive(m)	pthread_mutex_unlock(m)
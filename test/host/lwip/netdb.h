@@ -0,0 +1,4 @@
+/* EPDSign host stand-in for lwIP DNS */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+#include <netdb.h>
@@ -0,0 +1,25 @@
+/* EPDSign host stand-ins for ESP-IDF and RevK, enough to build snmp.c on a host */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern uint32_t host_uptime;    // Set by the test, so timeouts do not need real time
+
+static inline uint32_t
+uptime (void)
+{
+   return host_uptime;
+}
+
+static inline uint32_t
+esp_random (void)
+{
+   return random () ^ (random () << 16);
+}
+
+#define	ESP_LOGE(tag,...)	do{if(getenv("SNMPLOG")){fprintf(stderr,"%s: ",tag);fprintf(stderr,__VA_ARGS__);fputc('\n',stderr);}}while(0)
+#define	revk_task(tag,fn,arg,stack)	((void)(fn))    // Test drives the task loop itself
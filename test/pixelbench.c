@@ -0,0 +1,257 @@
+/* EPDSign image redraw benchmark */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Compares the old redraw, inflate the image again and gfx_pixel() for every pixel, with planes_blit() of the pre-rendered planes, for each panel size, run on a host
+// The image is 8 bit RGBA rows, as a PNG would be, deflated by zlib, PNG filtering and lwpng itself are not included, so old is if anything too fast
+// gfx_pixel() is a model of the GFX library, bounds check, flip, invert, and set one bit in the frame buffer
+// Build with -DCONFIG_GFX_BUILD_SUFFIX_EPD75R for the three colour classification
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+typedef int16_t gfx_pos_t;
+#define	GFX_L	1
+#define	GFX_T	4
+static void gfx_pos (gfx_pos_t x, gfx_pos_t y, uint8_t a);
+static void gfx_fill (gfx_pos_t w, gfx_pos_t h, uint8_t v);
+#include "../main/planes.h"
+
+static const struct
+{
+   const char *name;
+   uint32_t w,
+     h;
+} panels[] = {
+   {"EPD75", 800, 480},
+   {"EPD154/SSD1681", 200, 200},
+   {"EPD29", 128, 296},
+};
+
+static uint32_t gw,
+  gh;                           // Panel size
+static uint8_t gflip = 0,
+   ginvert = 0;
+static uint8_t *fb;             // Frame buffer
+
+static void __attribute__((noinline)) gfx_pixel (int32_t x, int32_t y, uint8_t v)
+{                               // As GFX does per pixel
+   if (gflip & 4)
+   {
+      int32_t t = x;
+      x = y;
+      y = t;
+   }
+   if (gflip & 1)
+      x = gw - 1 - x;
+   if (gflip & 2)
+      y = gh - 1 - y;
+   if (x < 0 || y < 0 || x >= gw || y >= gh)
+      return;
+   if (ginvert)
+      v ^= 0xFF;
+   uint32_t o = y * ((gw + 7) / 8) + x / 8;
+   uint8_t m = 0x80 >> (x & 7);
+   if (v & 0x80)
+      fb[o] |= m;
+   else
+      fb[o] &= ~m;
+}
+
+static gfx_pos_t posx,
+  posy;
+static uint8_t colour;          // Value for set pixels
+
+static void
+gfx_pos (gfx_pos_t x, gfx_pos_t y, uint8_t a)
+{
+   posx = x;
+   posy = y;
+}
+
+static void __attribute__((noinline)) gfx_fill (gfx_pos_t w, gfx_pos_t h, uint8_t v)
+{                               // Per pixel, as GFX does
+   for (gfx_pos_t y = 0; y < h; y++)
+      for (gfx_pos_t x = 0; x < w; x++)
+         gfx_pixel (posx + x, posy + y, v ? colour : 0);
+}
+
+typedef struct
+{
+   uint32_t ox,
+     oy;
+} plot_t;
+
+static const char *__attribute__((noinline)) old_pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{                               // The original callback
+   plot_t *p = opaque;
+   if (a & 0x8000)
+      gfx_pixel (p->ox + x, p->oy + y, (g & 0x8000) ? 255 : 0);
+   return NULL;
+}
+
+static void
+set_pixel (planes_t * p, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{                               // As pixel() in EPDSign.c, done once per image
+   if (x >= p->w || y >= p->h || !(a & 0x8000))
+      return;
+   uint32_t o = y * p->line + x / 8;
+   uint8_t m = (0x80 >> (x & 7));
+   p->mask[o] |= m;
+#ifdef	PLANES_RED
+   switch (planes_inkof (r, g, b))
+   {
+   case INK_WHITE:
+      p->bits[o] |= m;
+      break;
+   case INK_RED:
+      if (!p->red)
+         p->red = calloc (p->line, p->h);
+      p->bits[o] |= m;
+      p->red[o] |= m;
+      break;
+   }
+#else
+   if (g & 0x8000)
+      p->bits[o] |= m;
+#endif
+}
+
+static uint8_t *rgba;           // Test image, 8 bit RGBA rows
+static uint8_t *z;              // Deflated
+static uLongf zlen;
+
+static void
+old_redraw (plot_t * plot, uint32_t w, uint32_t h)
+{                               // As the decoder did every minute, inflate, and every pixel of every row
+   uLongf len = w * h * 4;
+   if (uncompress (rgba, &len, z, zlen) != Z_OK || len != w * h * 4)
+   {
+      fprintf (stderr, "Inflate failed\n");
+      exit (1);
+   }
+   for (uint32_t y = 0; y < h; y++)
+   {
+      uint8_t *p = rgba + y * w * 4;
+      for (uint32_t x = 0; x < w; x++, p += 4)
+         old_pixel (plot, x, y, p[0] * 257, p[1] * 257, p[2] * 257, p[3] * 257);
+   }
+}
+
+static uint64_t
+ns (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int
+main (int argc, char *argv[])
+{
+   int loops = (argc > 1 ? atoi (argv[1]) : 20);
+   int fails = 0;
+#ifdef	PLANES_RED
+   planes_ink ();
+   printf ("Three colour\n");
+#endif
+   for (int n = 0; n < sizeof (panels) / sizeof (*panels); n++)
+   {
+      gw = panels[n].w;
+      gh = panels[n].h;
+      uint32_t line = (gw + 31) / 32 * 4,
+         fline = (gw + 7) / 8;
+      fb = calloc (fline, gh);
+      rgba = malloc (gw * gh * 4);
+      for (uint32_t y = 0; y < gh; y++)
+         for (uint32_t x = 0; x < gw; x++)
+         {                      // Mostly solid runs, like a sign, some transparent and some red
+            uint8_t *p = rgba + (y * gw + x) * 4;
+            uint32_t i = (y & 7) * gw + x;
+            uint8_t v = ((i / 37) & 1) ? 0xFF : 0;
+            p[0] = p[1] = p[2] = v;
+            p[3] = ((i / 101) % 5 ? 0xFF : 0);
+            if (!(i / 53 % 7))
+            {
+               p[0] = 0xFF;
+               p[1] = p[2] = 0;
+            }
+         }
+      zlen = compressBound (gw * gh * 4);
+      z = malloc (zlen);
+      compress2 (z, &zlen, rgba, gw * gh * 4, 9);
+      planes_t p = {.w = gw,.h = gh,.line = line };
+      p.bits = calloc (line, gh);
+      p.mask = calloc (line, gh);
+      for (uint32_t y = 0; y < gh; y++)
+         for (uint32_t x = 0; x < gw; x++)
+         {
+            uint8_t *q = rgba + (y * gw + x) * 4;
+            set_pixel (&p, x, y, q[0] * 257, q[1] * 257, q[2] * 257, q[3] * 257);
+         }
+      plot_t plot = { 0 };
+      uint64_t old = -1,
+         redraw = -1;
+      for (int l = 0; l < loops; l++)
+      {                         // Best of
+         memset (fb, 0, fline * gh);
+         uint64_t start = ns ();
+         old_redraw (&plot, gw, gh);
+         uint64_t t = ns () - start;
+         if (t < old)
+            old = t;
+      }
+      uint32_t words = line * gh / 4;
+      uint32_t *k = malloc (line * gh),
+         *w = malloc (line * gh);
+      for (uint32_t i = 0; i < words; i++)
+      {                         // Pre-render, normal plot mode, red is only drawn once
+         k[i] = ((uint32_t *) p.mask)[i] & ~((uint32_t *) p.bits)[i];
+         w[i] = ((uint32_t *) p.mask)[i] & ((uint32_t *) p.bits)[i] & (p.red ? ~((uint32_t *) p.red)[i] : ~0);
+      }
+      uint8_t *oldfb = malloc (fline * gh);
+      memcpy (oldfb, fb, fline * gh);
+      for (int l = 0; l < loops; l++)
+      {
+         memset (fb, 0, fline * gh);
+         uint64_t start = ns ();
+         colour = 0;
+         planes_blit ((uint8_t *) k, gw, gh, line, 0, 0, 0, 0x7FFF);
+         colour = 255;
+         planes_blit ((uint8_t *) w, gw, gh, line, 0, 0, 0, 0x7FFF);
+         if (p.red)
+            planes_blit (p.red, gw, gh, line, 0, 0, 0, 0x7FFF);
+         uint64_t t = ns () - start;
+         if (t < redraw)
+            redraw = t;
+      }
+      for (uint32_t i = 0; i < fline * gh; i++)
+      {                         // Same as old, apart from red, which old could not do
+         uint8_t r = 0;
+         if (p.red)
+            for (int b = 0; b < 8 && i % fline * 8 + b < gw; b++)
+               if (p.red[i / fline * line + i % fline] & (0x80 >> b))
+                  r |= (0x80 >> b);
+         if ((oldfb[i] ^ fb[i]) & ~r)
+         {
+            fails++;
+            fprintf (stderr, "%s redraw differs at byte %u\n", panels[n].name, i);
+            break;
+         }
+      }
+      printf ("%-16s %4ux%-4u redraw old %6.2fms new %6.2fms (%.1fx)\n", panels[n].name, gw, gh, old / 1e6, redraw / 1e6,
+              (double) old / redraw);
+      free (oldfb);
+      free (k);
+      free (w);
+      free (p.bits);
+      free (p.mask);
+      free (p.red);
+      free (rgba);
+      free (z);
+      free (fb);
+   }
+   return fails ? 1 : 0;
+}
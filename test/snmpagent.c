@@ -0,0 +1,118 @@
+/* EPDSign SNMP stand-in agent */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Answers GetRequests on a UDP port, for testing the SNMP client on a host
+// sysUpTime, sysName, and sysDescr have values, anything else is noSuchObject
+// Options: -p port (default 1161), -d ms delay before each reply, -l percent of requests to ignore
+
+#include "snmpstub.h"
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef struct req_s
+{
+   int count;
+   binding_t b[SNMP_OIDS];
+} req_t;
+
+static struct timeval started;
+
+static void
+varbind (void *arg, const uint8_t * oid, uint32_t oidlen, uint8_t tag, const uint8_t * value, uint32_t len)
+{
+   req_t *r = arg;
+   if (r->count >= SNMP_OIDS || oidlen > SNMP_OIDMAX)
+      return;
+   binding_t *b = &r->b[r->count++];
+   memset (b, 0, sizeof (*b));
+   memcpy (b->oid.oid, oid, b->oid.len = oidlen);
+   uint8_t o[SNMP_OIDMAX];
+   int l;
+   if ((l = snmp_oid (o, sizeof (o), "1.3.6.1.2.1.1.3.0")) == oidlen && !memcmp (o, oid, l))
+   {                            // sysUpTime, timeticks
+      struct timeval now;
+      gettimeofday (&now, NULL);
+      uint32_t t = (now.tv_sec - started.tv_sec) * 100 + (now.tv_usec - started.tv_usec) / 10000 + 123456789;
+      b->tag = 0x43;
+      b->len = 4;
+      b->value[0] = t >> 24;
+      b->value[1] = t >> 16;
+      b->value[2] = t >> 8;
+      b->value[3] = t;
+   } else if ((l = snmp_oid (o, sizeof (o), "1.3.6.1.2.1.1.5.0")) == oidlen && !memcmp (o, oid, l))
+   {                            // sysName
+      b->tag = 0x04;
+      memcpy (b->value, "stand-in", b->len = 8);
+   } else if ((l = snmp_oid (o, sizeof (o), "1.3.6.1.2.1.1.1.0")) == oidlen && !memcmp (o, oid, l))
+   {                            // sysDescr
+      b->tag = 0x04;
+      memcpy (b->value, "FB2900 (V1.2.3)", b->len = 15);
+   } else
+      b->tag = 0x80;            // noSuchObject
+}
+
+int
+main (int argc, char *argv[])
+{
+   int port = 1161,
+      delay = 0,
+      loss = 0,
+      c;
+   while ((c = getopt (argc, argv, "p:d:l:")) >= 0)
+      switch (c)
+      {
+      case 'p':
+         port = atoi (optarg);
+         break;
+      case 'd':
+         delay = atoi (optarg);
+         break;
+      case 'l':
+         loss = atoi (optarg);
+         break;
+      default:
+         fprintf (stderr, "Usage: %s [-p port] [-d ms] [-l percent]\n", argv[0]);
+         return 1;
+      }
+   gettimeofday (&started, NULL);
+   int s = socket (AF_INET6, SOCK_DGRAM, 0);
+   if (s < 0)
+   {
+      perror ("socket");
+      return 1;
+   }
+   int off = 0;
+   setsockopt (s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+   struct sockaddr_in6 a = {.sin6_family = AF_INET6,.sin6_port = htons (port),.sin6_addr = in6addr_any };
+   if (bind (s, (struct sockaddr *) &a, sizeof (a)))
+   {
+      perror ("bind");
+      return 1;
+   }
+   fprintf (stderr, "Agent on port %d\n", port);
+   while (1)
+   {
+      uint8_t buf[SNMP_PKTMAX];
+      struct sockaddr_storage from;
+      socklen_t fromlen = sizeof (from);
+      ssize_t len = recvfrom (s, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen);
+      if (len <= 0)
+         continue;
+      uint32_t id;
+      size_t pdu = 0;
+      if (request_id (buf, len, &id, &pdu))
+         continue;
+      if (loss && rand () % 100 < loss)
+         continue;
+      buf[pdu] = 0xA2;          // Request as response, so we can use the decoder to list the OIDs
+      req_t r = { 0 };
+      if (snmp_decode (buf, len, id, varbind, &r))
+         continue;
+      if (delay)
+         usleep (delay * 1000);
+      len = response (buf, id, 0, r.count, r.b);
+      sendto (s, buf, len, 0, (struct sockaddr *) &from, fromlen);
+   }
+}
@@ -0,0 +1,191 @@
+/* EPDSign SNMP poller test */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Tests the poll, retry, give up, stale value, and resolve logic of snmp.c against snmpagent, run on a host
+// snmp.c is included, with host stand-ins for ESP-IDF, so the test can drive the task loop and set uptime
+
+#define	_GNU_SOURCE
+#define	SNMP_PORT	"1162"
+#include "../main/snmp.c"
+#include <signal.h>
+#include <sys/wait.h>
+
+#define	INTERVAL	60
+
+uint32_t host_uptime = 1000;
+static int fails = 0;
+static pid_t agentpid = 0;
+
+#define	CHECK(x)	do{if(!(x)){fprintf(stderr,"%s:%d: FAIL %s\n",__FILE__,__LINE__,#x);fails++;}}while(0)
+
+static void
+agent (const char *delay, const char *loss)
+{                               // (Re)start stand-in agent
+   if (agentpid)
+   {
+      kill (agentpid, SIGTERM);
+      waitpid (agentpid, NULL, 0);
+   }
+   agentpid = fork ();
+   if (!agentpid)
+   {
+      execl ("./snmpagent", "snmpagent", "-p", SNMP_PORT, "-d", delay, "-l", loss, NULL);
+      _exit (1);
+   }
+   usleep (200000);
+}
+
+static int
+step (int ms)
+{                               // One pass of the task loop, waiting up to ms for replies, returns 1 if there were any
+   fd_set r;
+   int max = snmp_due (&r);
+   if (max < 0)
+      return 0;
+   struct timeval tv = {.tv_sec = ms / 1000,.tv_usec = (ms % 1000) * 1000 };
+   if (select (max + 1, &r, NULL, NULL, &tv) <= 0)
+      return 0;
+   snmp_rx (&r);
+   return 1;
+}
+
+static snmp_target_t *
+target (const char *host)
+{
+   for (int n = 0; n < SNMP_TARGETS; n++)
+      if (targets[n].host && !strcmp (targets[n].host, host))
+         return &targets[n];
+   return NULL;
+}
+
+static void
+test_poll (int up, int name)
+{                               // Replies, and polls only once per interval
+   snmp_target_t *t = target ("localhost");
+   CHECK (t);
+   if (!t)
+      return;
+   CHECK (step (1000));
+   snmp_value_t v = { 0 };
+   CHECK (!snmp_get (up, &v) && v.tag == 0x43 && v.n >= 123456789 && v.when == host_uptime);
+   CHECK (!snmp_get (name, &v) && v.tag == 0x04 && !strcmp (v.s, "stand-in"));
+   CHECK (t->addrlen && !t->tries && t->next == host_uptime + INTERVAL);
+   host_uptime += INTERVAL - 1;
+   CHECK (!step (100));         // Not due
+   CHECK (!snmp_get (up, &v) && v.when == host_uptime - (INTERVAL - 1));
+   host_uptime++;
+   CHECK (step (1000));         // Due
+   CHECK (!snmp_get (up, &v) && v.when == host_uptime);
+}
+
+static void
+test_lost (int up)
+{                               // Every request lost, tries SNMP_TRIES times then waits for next interval, keeping the old value
+   snmp_target_t *t = target ("localhost");
+   if (!t)
+      return;
+   snmp_value_t old = { 0 },
+      v;
+   CHECK (!snmp_get (up, &old));
+   host_uptime = t->next;
+   for (int n = 1; n <= SNMP_TRIES; n++)
+   {
+      CHECK (!step (100));
+      CHECK (t->tries == n && t->next == host_uptime + SNMP_WAIT);
+      host_uptime += SNMP_WAIT;
+   }
+   CHECK (!step (100));         // Gives up
+   CHECK (!t->tries && t->next == host_uptime + INTERVAL);
+   CHECK (!snmp_get (up, &v) && v.when == old.when && v.n == old.n);  // Stale, caller decides by when
+}
+
+static void
+test_slow (int up)
+{                               // Reply slower than SNMP_WAIT, a reply to the first send is still accepted after the resend
+   snmp_target_t *t = target ("localhost");
+   if (!t)
+      return;
+   host_uptime = t->next;
+   uint32_t id = 0;
+   CHECK (!step (100));
+   id = t->id;
+   CHECK (t->tries == 1);
+   host_uptime += SNMP_WAIT;
+   CHECK (!step (100));
+   CHECK (t->tries == 2 && t->id == id);        // Same request ID on resend
+   for (int n = 0; n < 40 && t->tries; n++)
+      step (100);
+   snmp_value_t v;
+   CHECK (!t->tries && t->next == host_uptime + INTERVAL);
+   CHECK (!snmp_get (up, &v) && v.when == host_uptime && v.rtt >= 300);
+   for (int n = 0; n < 20; n++)
+      step (100);               // Late reply to resend is ignored
+   CHECK (!t->tries && t->next == host_uptime + INTERVAL);
+}
+
+static void
+test_resolve (int up)
+{                               // Closed after a send failure, resolves again on the next poll
+   snmp_target_t *t = target ("localhost");
+   if (!t)
+      return;
+   target_close (t);
+   CHECK (!t->addrlen && t->sock < 0);
+   host_uptime = t->next;
+   CHECK (step (1000));
+   snmp_value_t v;
+   CHECK (t->addrlen && t->sock >= 0 && !t->tries);
+   CHECK (!snmp_get (up, &v) && v.when == host_uptime);
+}
+
+static void
+test_unresolved (void)
+{                               // A host that does not resolve counts each attempt as a try, then waits for next interval
+   int h = snmp_watch ("nonexistent.invalid", "1.3.6.1.2.1.1.3.0");
+   CHECK (h >= 0);
+   snmp_target_t *t = target ("nonexistent.invalid");
+   if (!t)
+      return;
+   for (int n = 1; n <= SNMP_TRIES; n++)
+   {
+      step (0);
+      CHECK (!t->addrlen && t->tries == n && t->next == host_uptime + SNMP_WAIT);
+      host_uptime += SNMP_WAIT;
+   }
+   step (0);
+   CHECK (!t->tries && t->next == host_uptime + INTERVAL);
+   snmp_value_t v;
+   CHECK (snmp_get (h, &v));
+   snmp_forget ("nonexistent.invalid");
+   CHECK (!target ("nonexistent.invalid"));
+}
+
+int
+main (int argc, char *argv[])
+{
+   signal (SIGPIPE, SIG_IGN);
+   snmp_init (INTERVAL);
+   int up = snmp_watch ("localhost", "1.3.6.1.2.1.1.3.0"),
+      name = snmp_watch ("localhost", "1.3.6.1.2.1.1.5.0");
+   CHECK (up >= 0 && name >= 0 && up != name);
+   CHECK (snmp_watch ("localhost", "1.3.6.1.2.1.1.3.0") == up);
+   CHECK (snmp_watch ("localhost", "1.3.x") < 0);
+   agent ("0", "0");
+   test_poll (up, name);
+   agent ("0", "100");
+   test_lost (up);
+   agent ("500", "0");
+   test_slow (up);
+   agent ("0", "0");
+   test_resolve (up);
+   test_unresolved ();
+   kill (agentpid, SIGTERM);
+   waitpid (agentpid, NULL, 0);
+   if (fails)
+   {
+      fprintf (stderr, "%d failed\n", fails);
+      return 1;
+   }
+   printf ("Poller tests passed\n");
+   return 0;
+}
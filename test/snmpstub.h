@@ -0,0 +1,100 @@
+/* EPDSign SNMP test helpers */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Shared by snmptest and snmpagent, builds GetResponse messages the way an agent would
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../main/snmp.h"
+
+#define	VALMAX	16              // Max value length in a test binding
+
+typedef struct binding_s
+{
+   snmp_oid_t oid;
+   uint8_t tag;                 // Value tag
+   uint8_t len;                 // Value length
+   uint8_t value[VALMAX];       // Value
+} binding_t;
+
+static size_t
+tlv (uint8_t * p, uint8_t tag, const uint8_t * v, size_t len)
+{                               // Write tag, length, value, returns bytes written
+   size_t n = 0;
+   p[n++] = tag;
+   if (len >= 0x100)
+   {
+      p[n++] = 0x82;
+      p[n++] = len >> 8;
+   } else if (len >= 0x80)
+      p[n++] = 0x81;
+   p[n++] = len;
+   memmove (p + n, v, len);
+   return n + len;
+}
+
+static size_t
+tlv_int (uint8_t * p, uint32_t v)
+{                               // Write unsigned integer, minimal
+   uint8_t c[5] = { 0, v >> 24, v >> 16, v >> 8, v };
+   int s = 0;
+   while (s < 4 && !c[s] && !(c[s + 1] & 0x80))
+      s++;
+   return tlv (p, 0x02, c + s, 5 - s);
+}
+
+static size_t
+response (uint8_t * buf, uint32_t id, uint32_t status, int count, const binding_t * b)
+{                               // Make a v2c GetResponse, returns length
+   uint8_t vbs[SNMP_PKTMAX],
+     pdu[SNMP_PKTMAX],
+     msg[SNMP_PKTMAX];
+   size_t l = 0;
+   for (int n = 0; n < count; n++)
+   {
+      uint8_t vb[SNMP_PKTMAX];
+      size_t v = tlv (vb, 0x06, b[n].oid.oid, b[n].oid.len);
+      v += tlv (vb + v, b[n].tag, b[n].value, b[n].len);
+      l += tlv (vbs + l, 0x30, vb, v);
+   }
+   size_t p = tlv_int (pdu, id);
+   p += tlv_int (pdu + p, status);
+   p += tlv_int (pdu + p, 0);
+   p += tlv (pdu + p, 0x30, vbs, l);
+   size_t m = tlv_int (msg, 1);
+   m += tlv (msg + m, 0x04, (const uint8_t *) "public", 6);
+   m += tlv (msg + m, 0xA2, pdu, p);
+   return tlv (buf, 0x30, msg, m);
+}
+
+static int
+request_id (const uint8_t * buf, size_t len, uint32_t * id, size_t * pdu)
+{                               // Request ID, and offset of PDU tag, from a GetRequest made by snmp_encode_get, returns 0 if found
+   size_t p = 0;
+   uint8_t skip[] = { 0x30, 0x02, 0x04, 0xA0 };        // Into message, over version and community, into PDU
+   for (int s = 0; s < sizeof (skip); s++)
+   {
+      if (p + 2 > len || buf[p] != skip[s])
+         return -1;
+      if (s == 3)
+         *pdu = p;
+      size_t l = buf[p + 1],
+         h = 2;
+      if (l == 0x81 || l == 0x82)
+      {
+         h += l - 0x80;
+         l = (l == 0x81 ? buf[p + 2] : (buf[p + 2] << 8) + buf[p + 3]);
+      }
+      p += h + ((s == 1 || s == 2) ? l : 0);
+   }
+   if (p + 2 > len || buf[p] != 0x02 || buf[p + 1] > 4 || p + 2 + buf[p + 1] > len)
+      return -1;
+   uint32_t v = 0;
+   for (int n = 0; n < buf[p + 1]; n++)
+      v = (v << 8) + buf[p + 2 + n];
+   *id = v;
+   return 0;
+}
@@ -0,0 +1,331 @@
+/* EPDSign SNMP codec test */
+/* Copyright ©2019 - 2023 Adrian Kennard, Andrews & Arnold Ltd.See LICENCE file for details .GPL 3.0 */
+
+// Unit tests and benchmark for the BER codec, run on a host
+// With host and port, also times round trips to an agent, e.g. snmpagent
+
+#define	_GNU_SOURCE
+#include "snmpstub.h"
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+static int fails = 0;
+
+#define	CHECK(x)	do{if(!(x)){fprintf(stderr,"%s:%d: FAIL %s\n",__FILE__,__LINE__,#x);fails++;}}while(0)
+
+static uint64_t
+ns (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+typedef struct got_s
+{
+   int count;
+   binding_t b[SNMP_OIDS];
+   int64_t n[SNMP_OIDS];
+} got_t;
+
+static void
+varbind (void *arg, const uint8_t * oid, uint32_t oidlen, uint8_t tag, const uint8_t * value, uint32_t len)
+{
+   got_t *g = arg;
+   if (g->count >= SNMP_OIDS || oidlen > SNMP_OIDMAX || len > VALMAX)
+      return;
+   binding_t *b = &g->b[g->count];
+   memcpy (b->oid.oid, oid, b->oid.len = oidlen);
+   b->tag = tag;
+   memcpy (b->value, value, b->len = len);
+   g->n[g->count++] = snmp_integer (tag, value, len);
+}
+
+static void
+oid (snmp_oid_t * o, const char *dotted)
+{
+   int l = snmp_oid (o->oid, sizeof (o->oid), dotted);
+   CHECK (l > 0);
+   o->len = (l > 0 ? l : 0);
+}
+
+static void
+test_oid (void)
+{
+   uint8_t o[SNMP_OIDMAX];
+   static const uint8_t uptime[] = { 0x2B, 6, 1, 2, 1, 1, 3, 0 };
+   CHECK (snmp_oid (o, sizeof (o), "1.3.6.1.2.1.1.3.0") == sizeof (uptime) && !memcmp (o, uptime, sizeof (uptime)));
+   CHECK (snmp_oid (o, sizeof (o), ".1.3.6.1.2.1.1.3.0") == sizeof (uptime));
+   static const uint8_t big[] = { 0x2B, 6, 1, 4, 1, 0x8F, 0x65, 0x8F, 0xFF, 0xFF, 0xFF, 0x7F };
+   CHECK (snmp_oid (o, sizeof (o), "1.3.6.1.4.1.2021.4294967295") == sizeof (big) && !memcmp (o, big, sizeof (big)));
+   CHECK (snmp_oid (o, sizeof (o), "2.999.1") == 3 && o[0] == 0x88 && o[1] == 0x37);
+   CHECK (snmp_oid (o, sizeof (o), "1") < 0);
+   CHECK (snmp_oid (o, sizeof (o), "") < 0);
+   CHECK (snmp_oid (o, sizeof (o), "3.1") < 0);
+   CHECK (snmp_oid (o, sizeof (o), "1.40") < 0);
+   CHECK (snmp_oid (o, sizeof (o), "1.3.x") < 0);
+   CHECK (snmp_oid (o, sizeof (o), "1.3..6") < 0);
+   CHECK (snmp_oid (o, 2, "1.3.6.1") < 0);   // No space
+}
+
+static void
+test_integer (void)
+{
+   CHECK (snmp_integer (0x02, (const uint8_t *) "\x80", 1) == -128);
+   CHECK (snmp_integer (0x02, (const uint8_t *) "\x00\x80", 2) == 128);
+   CHECK (snmp_integer (0x41, (const uint8_t *) "\xFF", 1) == 255);   // Counter is unsigned
+   CHECK (snmp_integer (0x46, (const uint8_t *) "\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 9) == -1);        // Counter64 top bit, wraps
+   CHECK (snmp_integer (0x02, (const uint8_t *) "", 0) == 0);
+   CHECK (snmp_integer (0x02, (const uint8_t *) "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A", 10) == 0);       // Too long
+}
+
+static void
+test_encode (void)
+{
+   snmp_oid_t o[3];
+   oid (&o[0], "1.3.6.1.2.1.1.3.0");
+   oid (&o[1], "1.3.6.1.2.1.1.5.0");
+   oid (&o[2], "1.3.6.1.2.1.1.1.0");
+   uint8_t buf[SNMP_PKTMAX];
+   // Known encoding of a GetRequest for sysUpTime.0, community public, request ID 0x12345678
+   static const uint8_t known[] = {
+      0x30, 0x29, 0x02, 0x01, 0x01, 0x04, 0x06, 'p', 'u', 'b', 'l', 'i', 'c', 0xA0, 0x1C, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78,
+      0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x0E, 0x30, 0x0C, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x03,
+      0x00, 0x05, 0x00
+   };
+   int l = snmp_encode_get (buf, sizeof (buf), "public", 0x12345678, 1, o);
+   CHECK (l == sizeof (known) && !memcmp (buf, known, sizeof (known)));
+   // Round trip, request turned in to a response
+   l = snmp_encode_get (buf, sizeof (buf), "public", 42, 3, o);
+   CHECK (l > 0);
+   uint32_t id = 0;
+   size_t pdu = 0;
+   CHECK (!request_id (buf, l, &id, &pdu) && id == 42);
+   buf[pdu] = 0xA2;
+   got_t g = { 0 };
+   CHECK (!snmp_decode (buf, l, 42, varbind, &g));
+   CHECK (g.count == 3);
+   for (int n = 0; n < 3 && n < g.count; n++)
+      CHECK (g.b[n].oid.len == o[n].len && !memcmp (g.b[n].oid.oid, o[n].oid, o[n].len) && g.b[n].tag == 0x05 && !g.b[n].len);
+   // Big ID
+   l = snmp_encode_get (buf, sizeof (buf), "public", 0x80000000, 1, o);
+   CHECK (!request_id (buf, l, &id, &pdu) && id == 0x80000000);
+   // Long enough to need two byte lengths
+   snmp_oid_t many[SNMP_OIDS];
+   for (int n = 0; n < SNMP_OIDS; n++)
+      oid (&many[n], "1.3.6.1.4.1.2021.4294967295.4294967295.4294967295.4294967295");
+   l = snmp_encode_get (buf, sizeof (buf), "public", 7, SNMP_OIDS, many);
+   CHECK (l > 0x100 && buf[1] == 0x82);
+   g.count = 0;
+   CHECK (!request_id (buf, l, &id, &pdu) && id == 7);
+   buf[pdu] = 0xA2;
+   CHECK (!snmp_decode (buf, l, 7, varbind, &g) && g.count == SNMP_OIDS);
+   // No space
+   for (int max = 0; max < sizeof (known); max++)
+      CHECK (snmp_encode_get (buf, max, "public", 0x12345678, 1, o) < 0);
+}
+
+static size_t
+sample (uint8_t * buf, uint32_t id, uint32_t status)
+{                               // Response with some typical values
+   binding_t b[4] = { 0 };
+   oid (&b[0].oid, "1.3.6.1.2.1.1.3.0");
+   b[0].tag = 0x43;
+   memcpy (b[0].value, "\x01\x02\x03\x04", b[0].len = 4);
+   oid (&b[1].oid, "1.3.6.1.2.1.1.5.0");
+   b[1].tag = 0x04;
+   memcpy (b[1].value, "router", b[1].len = 6);
+   oid (&b[2].oid, "1.3.6.1.2.1.2.2.1.8.1");
+   b[2].tag = 0x02;
+   memcpy (b[2].value, "\xFF", b[2].len = 1);
+   oid (&b[3].oid, "1.3.6.1.2.1.1.9.9");
+   b[3].tag = 0x80;             // noSuchObject
+   return response (buf, id, status, 4, b);
+}
+
+static void
+test_decode (void)
+{
+   uint8_t buf[SNMP_PKTMAX];
+   size_t l = sample (buf, 99, 0);
+   got_t g = { 0 };
+   CHECK (!snmp_decode (buf, l, 99, varbind, &g));
+   CHECK (g.count == 4);
+   CHECK (g.b[0].tag == 0x43 && g.n[0] == 0x01020304);
+   CHECK (g.b[1].tag == 0x04 && g.b[1].len == 6 && !memcmp (g.b[1].value, "router", 6));
+   CHECK (g.b[2].tag == 0x02 && g.n[2] == -1);
+   CHECK (g.b[3].tag == 0x80 && !g.b[3].len);
+   // Wrong request ID
+   g.count = 0;
+   const char *e = snmp_decode (buf, l, 98, varbind, &g);
+   CHECK (e && !strcmp (e, "Wrong request ID") && !g.count);
+   // Error status
+   l = sample (buf, 99, 2);
+   e = snmp_decode (buf, l, 99, varbind, &g);
+   CHECK (e && !strcmp (e, "Error status") && !g.count);
+   // Truncated, every length short of whole, must fail and not read past end
+   l = sample (buf, 99, 0);
+   for (size_t n = 0; n < l; n++)
+   {
+      uint8_t *t = malloc (n ? : 1);
+      memcpy (t, buf, n);
+      g.count = 0;
+      CHECK (snmp_decode (t, n, 99, varbind, &g));
+      free (t);
+   }
+   // Malformed
+   static const struct
+   {
+      const char *what;
+      uint8_t len;
+      uint8_t data[16];
+   } bad[] = {
+      {"Empty", 0, {}},
+      {"Not a sequence", 2, {0x04, 0x00}},
+      {"Length past end", 2, {0x30, 0x05}},
+      {"Indefinite length", 4, {0x30, 0x80, 0x00, 0x00}},
+      {"Long length past end", 6, {0x30, 0x84, 0xFF, 0xFF, 0xFF, 0xFF}},
+      {"Five byte length", 7, {0x30, 0x85, 0x00, 0x00, 0x00, 0x00, 0x00}},
+      {"High tag", 4, {0x30, 0x02, 0x1F, 0x00}},
+      {"Request not response", 13, {0x30, 0x0B, 0x02, 0x01, 0x01, 0x04, 0x00, 0xA0, 0x04, 0x02, 0x01, 0x63, 0x00}},
+   };
+   for (int n = 0; n < sizeof (bad) / sizeof (*bad); n++)
+   {
+      g.count = 0;
+      e = snmp_decode (bad[n].data, bad[n].len, 99, varbind, &g);
+      if (!e)
+         fprintf (stderr, "Accepted: %s\n", bad[n].what);
+      CHECK (e && !g.count);
+   }
+   // Binding that is not a sequence, and OID that is not an OID
+   l = sample (buf, 99, 0);
+   uint8_t *p = memmem (buf, l, "\x30\x10\x06\x08\x2B", 5);     // First binding
+   CHECK (p);
+   if (p)
+   {
+      p[0] = 0x31;
+      CHECK (snmp_decode (buf, l, 99, varbind, &g));
+      p[0] = 0x30;
+      p[2] = 0x04;
+      CHECK (snmp_decode (buf, l, 99, varbind, &g));
+   }
+}
+
+static void
+bench (void)
+{
+   snmp_oid_t o[3];
+   oid (&o[0], "1.3.6.1.2.1.1.3.0");
+   oid (&o[1], "1.3.6.1.2.1.1.5.0");
+   oid (&o[2], "1.3.6.1.2.1.1.1.0");
+   uint8_t buf[SNMP_PKTMAX];
+   const int loops = 1000000;
+   uint64_t start = ns ();
+   for (int n = 0; n < loops; n++)
+      snmp_encode_get (buf, sizeof (buf), "public", n, 3, o);
+   uint64_t enc = ns () - start;
+   size_t l = sample (buf, 99, 0);
+   got_t g;
+   start = ns ();
+   for (int n = 0; n < loops; n++)
+   {
+      g.count = 0;
+      snmp_decode (buf, l, 99, varbind, &g);
+   }
+   uint64_t dec = ns () - start;
+   printf ("Encode 3 OIDs %.0fns, decode 4 bindings %.0fns\n", (double) enc / loops, (double) dec / loops);
+}
+
+static int
+cmp (const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *) a,
+      y = *(const uint64_t *) b;
+   return x < y ? -1 : x > y;
+}
+
+static int
+agent (const char *host, const char *port, int count)
+{                               // Round trips to an agent
+   struct addrinfo hints = {.ai_socktype = SOCK_DGRAM },
+      *res = NULL;
+   if (getaddrinfo (host, port, &hints, &res) || !res)
+   {
+      fprintf (stderr, "Cannot resolve %s\n", host);
+      return 1;
+   }
+   int s = socket (res->ai_family, SOCK_DGRAM, 0);
+   if (s < 0 || connect (s, res->ai_addr, res->ai_addrlen))
+   {
+      perror ("socket");
+      return 1;
+   }
+   freeaddrinfo (res);
+   snmp_oid_t o[3];
+   oid (&o[0], "1.3.6.1.2.1.1.3.0");
+   oid (&o[1], "1.3.6.1.2.1.1.5.0");
+   oid (&o[2], "1.3.6.1.2.1.1.1.0");
+   uint64_t *rtt = calloc (count, sizeof (*rtt));
+   int ok = 0,
+      lost = 0,
+      bad = 0;
+   for (int n = 0; n < count; n++)
+   {
+      uint8_t buf[SNMP_PKTMAX];
+      uint32_t id = n + 1;
+      int l = snmp_encode_get (buf, sizeof (buf), "public", id, 3, o);
+      uint64_t start = ns ();
+      send (s, buf, l, 0);
+      struct pollfd p = {.fd = s,.events = POLLIN };
+      if (poll (&p, 1, 1000) <= 0)
+      {
+         lost++;
+         continue;
+      }
+      l = recv (s, buf, sizeof (buf), 0);
+      uint64_t t = ns () - start;
+      got_t g = { 0 };
+      if (l <= 0 || snmp_decode (buf, l, id, varbind, &g) || g.count != 3 || g.b[0].tag != 0x43)
+      {
+         bad++;
+         continue;
+      }
+      rtt[ok++] = t;
+   }
+   if (ok)
+   {
+      qsort (rtt, ok, sizeof (*rtt), cmp);
+      uint64_t sum = 0;
+      for (int n = 0; n < ok; n++)
+         sum += rtt[n];
+      printf ("Agent %d ok, %d lost, %d bad, rtt min %.0fus avg %.0fus p95 %.0fus max %.0fus\n", ok, lost, bad,
+              rtt[0] / 1e3, sum / ok / 1e3, rtt[(ok * 95 + 99) / 100 - 1] / 1e3, rtt[ok - 1] / 1e3);
+   } else
+      printf ("Agent no replies, %d lost, %d bad\n", lost, bad);
+   free (rtt);
+   close (s);
+   return !ok || bad;
+}
+
+int
+main (int argc, char *argv[])
+{
+   test_oid ();
+   test_integer ();
+   test_encode ();
+   test_decode ();
+   if (fails)
+   {
+      fprintf (stderr, "%d failed\n", fails);
+      return 1;
+   }
+   printf ("Tests passed\n");
+   if (argc > 1 && !strcmp (argv[1], "-b"))
+      bench ();
+   if (argc > 3 && !strcmp (argv[1], "-b"))
+      return agent (argv[2], argv[3], argc > 4 ? atoi (argv[4]) : 1000);
+   return 0;
+}